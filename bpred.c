@@ -0,0 +1,352 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bpred.h"
+#include "config.h"
+#include "symbols.h"
+#include "display.h"
+
+/****************************************************************************
+ * Branch prediction models.
+ *
+ * Conditional branches are predicted by one of
+ *
+ *   static   backward taken, forward not taken
+ *   bimodal  a table of two bit counters, indexed by the branch address
+ *   gshare   the same, indexed by the address XORed with the global history
+ *
+ * and returns by a return address stack, pushed by calls and popped by
+ * returns (using the same ra/t0 hints as the profiler). JAL always goes
+ * where it should, as its target is known when it is decoded. Any other
+ * JALR (say a far call, or through a function pointer) is predicted to go
+ * where it went last time, from a table as big as the counter table.
+ *
+ * A mispredict holds the CPU for the penalty while the pipeline refills.
+ * Every conditional branch is counted by address, for the report at exit.
+ ****************************************************************************/
+#define MODEL_STATIC  0
+#define MODEL_BIMODAL 1
+#define MODEL_GSHARE  2
+
+#define REG_RA 1
+#define REG_T0 5
+
+struct branch {
+  uint32_t pc;          /* 0 if the slot is free */
+  uint64_t executed;
+  uint64_t taken;
+  uint64_t mispredicted;
+};
+
+int bpred_active = 0;
+
+static int      model;
+static uint8_t  *counters;
+static uint32_t *targets;
+static uint32_t entries;
+static uint32_t history;
+static uint32_t history_bits;
+static uint32_t penalty;
+
+static uint32_t *ras;
+static uint32_t ras_size;
+static uint32_t ras_top;      /* Wraps, so the oldest entries get overwritten */
+static uint32_t ras_count;
+
+static struct branch *branches;
+static uint32_t n_branches;
+static uint32_t max_branches;
+
+static char report_file[128];
+
+static uint64_t returns, returns_mispredicted;
+static uint64_t indirect, indirect_mispredicted;
+static uint64_t penalty_cycles;
+
+static const char *model_names[] = { "static", "bimodal", "gshare" };
+
+/****************************************************************************/
+static int power_of_two(uint32_t n) {
+  return n != 0 && (n & (n-1)) == 0;
+}
+
+/****************************************************************************
+ * From a machine description line such as
+ *
+ *    bpred gshare entries=4096 history=12 ras=8 penalty=3 report=branches.txt
+ ****************************************************************************/
+int bpred_configure(const char *name, const char *options) {
+  char buffer[128];
+  uint32_t i;
+
+  for(model = 0; model < sizeof(model_names)/sizeof(char *); model++) {
+    if(strcmp(name, model_names[model]) == 0)
+      break;
+  }
+  if(model == sizeof(model_names)/sizeof(char *)) {
+    display_log("Branch predictor must be static, bimodal or gshare");
+    return 0;
+  }
+
+  entries      = 1024;
+  history_bits = 10;
+  ras_size     = 4;
+  penalty      = 3;
+  config_option_number(options, "entries", &entries);
+  config_option_number(options, "history", &history_bits);
+  config_option_number(options, "ras",     &ras_size);
+  config_option_number(options, "penalty", &penalty);
+  if(!config_option(options, "report", report_file, sizeof(report_file)))
+    report_file[0] = '\0';
+
+  if(!power_of_two(entries) || history_bits > 31) {
+    display_log("Branch predictor entries must be a power of two");
+    return 0;
+  }
+
+  free(counters);
+  free(targets);
+  free(ras);
+  counters = malloc(entries);
+  targets  = calloc(entries, sizeof(uint32_t));
+  ras      = calloc(ras_size ? ras_size : 1, sizeof(uint32_t));
+  if(counters == NULL || targets == NULL || ras == NULL)
+    return 0;
+  /* Weakly not taken */
+  for(i = 0; i < entries; i++)
+    counters[i] = 1;
+  history = 0;
+  ras_top = ras_count = 0;
+
+  max_branches = 1024;
+  free(branches);
+  branches = calloc(max_branches, sizeof(struct branch));
+  n_branches = 0;
+  if(branches == NULL)
+    return 0;
+
+  sprintf(buffer, "Branch predictor: %s, %u entries, %u deep return stack, %u cycle penalty",
+          model_names[model], entries, ras_size, penalty);
+  display_log(buffer);
+  bpred_active = 1;
+  return 1;
+}
+
+/****************************************************************************
+ * The counts for the branch at pc, from an open addressed hash table
+ ****************************************************************************/
+static struct branch *find(uint32_t pc) {
+  uint32_t i = (pc >> 2) * 2654435761u;
+
+  if(n_branches * 2 >= max_branches) {
+    struct branch *old = branches;
+    uint32_t old_max = max_branches, j;
+
+    branches = calloc(max_branches * 2, sizeof(struct branch));
+    if(branches == NULL) {
+      branches = old;
+    } else {
+      max_branches *= 2;
+      n_branches = 0;
+      for(j = 0; j < old_max; j++) {
+        if(old[j].pc != 0)
+          *find(old[j].pc) = old[j];
+      }
+      free(old);
+    }
+  }
+
+  for(i &= max_branches-1; branches[i].pc != 0 && branches[i].pc != pc; i = (i+1) & (max_branches-1))
+    ;
+  if(branches[i].pc == 0) {
+    branches[i].pc = pc;
+    n_branches++;
+  }
+  return branches+i;
+}
+
+/****************************************************************************
+ * A conditional branch at pc has been resolved. Returns the cycles lost.
+ ****************************************************************************/
+uint32_t bpred_branch(uint32_t pc, uint32_t target, int taken) {
+  struct branch *b = find(pc);
+  uint8_t *counter = NULL;
+  int predicted;
+
+  switch(model) {
+    case MODEL_BIMODAL:
+      counter = counters + ((pc >> 2) & (entries-1));
+      break;
+    case MODEL_GSHARE:
+      counter = counters + (((pc >> 2) ^ history) & (entries-1));
+      break;
+  }
+
+  if(counter == NULL)
+    predicted = target < pc;
+  else
+    predicted = *counter >= 2;
+
+  if(counter != NULL) {
+    if(taken && *counter < 3)
+      (*counter)++;
+    else if(!taken && *counter > 0)
+      (*counter)--;
+  }
+  history = ((history << 1) | taken) & ((1u << history_bits) - 1);
+
+  b->executed++;
+  b->taken += taken;
+  if(predicted == taken)
+    return 0;
+  b->mispredicted++;
+  penalty_cycles += penalty;
+  return penalty;
+}
+
+/****************************************************************************
+ * A JAL (rs1 is -1) or JALR has gone to target. Returns the cycles lost.
+ ****************************************************************************/
+uint32_t bpred_jump(uint32_t pc, uint32_t target, uint32_t next, int rd, int rs1) {
+  int rd_link  = (rd  == REG_RA || rd  == REG_T0);
+  int rs1_link = (rs1 == REG_RA || rs1 == REG_T0);
+  uint32_t lost = 0;
+
+  if(rs1 >= 0) {
+    if(rs1_link && (!rd_link || rd != rs1)) {
+      /* A return - right if it matches the top of the stack */
+      returns++;
+      if(ras_count > 0) {
+        ras_top = (ras_top + ras_size - 1) % ras_size;
+        ras_count--;
+        if(ras[ras_top] != target)
+          lost = penalty;
+      } else {
+        lost = penalty;
+      }
+      if(lost)
+        returns_mispredicted++;
+    } else {
+      /* Anything else - right if it goes where it did last time */
+      uint32_t *last = targets + ((pc >> 2) & (entries-1));
+      indirect++;
+      if(*last != target) {
+        indirect_mispredicted++;
+        lost = penalty;
+      }
+      *last = target;
+    }
+  }
+
+  if(rd_link && ras_size > 0) {
+    ras[ras_top] = next;
+    ras_top = (ras_top + 1) % ras_size;
+    if(ras_count < ras_size)
+      ras_count++;
+  }
+  penalty_cycles += lost;
+  return lost;
+}
+
+/****************************************************************************/
+static int compare(const void *a, const void *b) {
+  const struct branch *ba = a, *bb = b;
+
+  if(ba->mispredicted != bb->mispredicted)
+    return ba->mispredicted > bb->mispredicted ? -1 : 1;
+  return ba->pc < bb->pc ? -1 : 1;
+}
+
+/****************************************************************************
+ * Every conditional branch, worst first
+ ****************************************************************************/
+static void write_report(void) {
+  struct branch *list;
+  char buffer[200];
+  uint32_t i, n = 0;
+  FILE *f;
+
+  f = fopen(report_file, "w");
+  if(f == NULL) {
+    snprintf(buffer, sizeof(buffer), "Unable to open branch report '%s'", report_file);
+    display_log(buffer);
+    return;
+  }
+
+  list = malloc((n_branches+1) * sizeof(struct branch));
+  if(list == NULL) {
+    fclose(f);
+    return;
+  }
+  for(i = 0; i < max_branches; i++) {
+    if(branches[i].pc != 0)
+      list[n++] = branches[i];
+  }
+  qsort(list, n, sizeof(struct branch), compare);
+
+  fprintf(f, "%-40s %12s %7s %12s %7s\n", "branch", "executed", "taken", "mispredicted", "rate");
+  for(i = 0; i < n; i++) {
+    char name[64];
+    symbols_format(list[i].pc, name, sizeof(name));
+    snprintf(buffer, sizeof(buffer), "%08x %s", list[i].pc, name);
+    fprintf(f, "%-40.40s %12llu %6.2f%% %12llu %6.2f%%\n", buffer,
+            (unsigned long long)list[i].executed, 100.0 * list[i].taken / list[i].executed,
+            (unsigned long long)list[i].mispredicted, 100.0 * list[i].mispredicted / list[i].executed);
+  }
+  free(list);
+  fclose(f);
+
+  snprintf(buffer, sizeof(buffer), "Branch report of %u branches written to '%s'", n, report_file);
+  display_log(buffer);
+}
+
+/****************************************************************************
+ * Log how well it did, write the report, and tidy up
+ ****************************************************************************/
+void bpred_finish(void) {
+  uint64_t executed = 0, mispredicted = 0;
+  char buffer[200];
+  uint32_t i;
+
+  if(!bpred_active)
+    return;
+
+  for(i = 0; i < max_branches; i++) {
+    executed     += branches[i].executed;
+    mispredicted += branches[i].mispredicted;
+  }
+  snprintf(buffer, sizeof(buffer), "Branches: %llu, %llu mispredicted (%.2f%%) by %s",
+           (unsigned long long)executed, (unsigned long long)mispredicted,
+           executed ? 100.0 * mispredicted / executed : 0.0, model_names[model]);
+  display_log(buffer);
+  snprintf(buffer, sizeof(buffer), "Returns: %llu, %llu mispredicted. Other indirect jumps: %llu, %llu mispredicted",
+           (unsigned long long)returns, (unsigned long long)returns_mispredicted,
+           (unsigned long long)indirect, (unsigned long long)indirect_mispredicted);
+  display_log(buffer);
+  snprintf(buffer, sizeof(buffer), "Mispredict penalty: %llu cycles", (unsigned long long)penalty_cycles);
+  display_log(buffer);
+
+  if(report_file[0] != '\0')
+    write_report();
+
+  free(counters);
+  free(targets);
+  free(ras);
+  free(branches);
+  counters = NULL;
+  targets  = NULL;
+  ras      = NULL;
+  branches = NULL;
+  bpred_active = 0;
+}
+/****************************************************************************/
@@ -0,0 +1,10 @@
+#ifndef BPRED_H
+#define BPRED_H
+/* Set when a predictor is configured, so the CPU only calls in when it is wanted */
+extern int bpred_active;
+
+int      bpred_configure(const char *model, const char *options);
+uint32_t bpred_branch(uint32_t pc, uint32_t target, int taken);
+uint32_t bpred_jump(uint32_t pc, uint32_t target, uint32_t next, int rd, int rs1);
+void     bpred_finish(void);
+#endif
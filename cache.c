@@ -0,0 +1,343 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "cache.h"
+#include "config.h"
+#include "region.h"
+#include "memorymap.h"
+#include "display.h"
+
+/****************************************************************************
+ * Instruction and data cache models.
+ *
+ * Only the tags are kept - the data always comes from the memory map - so
+ * a cache changes how long an access takes, never what it returns. A hit
+ * costs nothing over the cycle every access takes. A miss costs filling
+ * the line, a word at a time at the region's speed, unless miss= gives a
+ * fixed penalty. The D-cache is write-through (stores go to memory as
+ * before, and don't allocate) unless write=back is given, when a store
+ * only marks the line dirty and evicting a dirty line costs writing it
+ * back.
+ *
+ * Like a region's latency, the cost holds up the memory system after the
+ * access rather than delaying its data, so it lands on whichever fetch,
+ * load or store comes next.
+ *
+ * Only memory regions are cached, and not those marked cacheable=no.
+ * Hits and misses are counted for each region, and logged at the end.
+ ****************************************************************************/
+#define REPLACE_LRU    0
+#define REPLACE_FIFO   1
+#define REPLACE_RANDOM 2
+
+struct line {
+  uint32_t tag;
+  uint32_t stamp;     /* Last use (LRU) or fill (FIFO) */
+  struct region_stats *owner;   /* Region the line was filled from */
+  uint8_t  valid;
+  uint8_t  dirty;
+};
+
+struct region_stats {
+  struct region *r;
+  uint64_t hits[2][2];      /* By cache, then read or write */
+  uint64_t misses[2][2];
+  uint64_t writebacks;
+  struct region_stats *next;
+};
+
+struct cache {
+  struct line *lines;   /* sets * ways, one set after another */
+  uint32_t size;
+  uint32_t ways;
+  uint32_t line_size;
+  uint32_t sets;
+  uint32_t line_shift;
+  uint32_t replace;
+  uint32_t miss;        /* Fixed miss penalty, or 0 to work it out */
+  uint8_t  write_back;
+  uint32_t clock;
+};
+
+static struct cache caches[2];
+static struct region_stats *stats;
+static struct region_stats *last_stats;
+static uint32_t random_state = 0x12345678;
+
+static const char *cache_names[2] = { "I-cache", "D-cache" };
+
+/****************************************************************************/
+static int power_of_two(uint32_t n) {
+  return n != 0 && (n & (n-1)) == 0;
+}
+
+/****************************************************************************
+ * From a machine description line such as
+ *
+ *    icache 16K ways=2 line=32 replace=lru
+ *    dcache 16K ways=4 line=64 replace=random write=back miss=20
+ ****************************************************************************/
+int cache_configure(int which, const char *size, const char *options) {
+  struct cache *c = caches + which;
+  char value[16];
+  char buffer[128];
+
+  c->ways      = 1;
+  c->line_size = 32;
+  c->replace   = REPLACE_LRU;
+  c->miss      = 0;
+  c->write_back = 0;
+
+  if(!config_number(size, &c->size)) {
+    sprintf(buffer, "%s: bad size", cache_names[which]);
+    display_log(buffer);
+    return 0;
+  }
+  config_option_number(options, "ways", &c->ways);
+  config_option_number(options, "line", &c->line_size);
+  config_option_number(options, "miss", &c->miss);
+
+  if(config_option(options, "replace", value, sizeof(value))) {
+    if(strcmp(value, "lru") == 0)
+      c->replace = REPLACE_LRU;
+    else if(strcmp(value, "fifo") == 0)
+      c->replace = REPLACE_FIFO;
+    else if(strcmp(value, "random") == 0)
+      c->replace = REPLACE_RANDOM;
+    else {
+      sprintf(buffer, "%s: replace= must be lru, fifo or random", cache_names[which]);
+      display_log(buffer);
+      return 0;
+    }
+  }
+
+  if(config_option(options, "write", value, sizeof(value))) {
+    if(which != CACHE_D || (strcmp(value, "back") != 0 && strcmp(value, "through") != 0)) {
+      sprintf(buffer, "%s: write= must be through or back, and only for the D-cache", cache_names[which]);
+      display_log(buffer);
+      return 0;
+    }
+    c->write_back = strcmp(value, "back") == 0;
+  }
+
+  if(!power_of_two(c->size) || !power_of_two(c->ways) || !power_of_two(c->line_size)
+     || c->line_size < 4 || c->ways * c->line_size > c->size) {
+    sprintf(buffer, "%s: size, ways and line must be powers of two that fit", cache_names[which]);
+    display_log(buffer);
+    return 0;
+  }
+
+  c->sets = c->size / (c->ways * c->line_size);
+  for(c->line_shift = 0; (1u << c->line_shift) < c->line_size; c->line_shift++)
+    ;
+  free(c->lines);
+  c->lines = calloc(c->sets * c->ways, sizeof(struct line));
+  if(c->lines == NULL)
+    return 0;
+
+  sprintf(buffer, "%s: %u bytes, %u way, %u byte lines, %u sets", cache_names[which],
+          c->size, c->ways, c->line_size, c->sets);
+  display_log(buffer);
+  return 1;
+}
+
+/****************************************************************************/
+int cache_enabled(int which) {
+  return caches[which].lines != NULL;
+}
+
+/****************************************************************************
+ * The counters for the region holding address, or NULL if it isn't cached
+ ****************************************************************************/
+static struct region_stats *region_stats(uint32_t address) {
+  struct region_stats *s;
+  struct region *r;
+
+  if(last_stats != NULL && address - last_stats->r->base < last_stats->r->size)
+    return last_stats;
+
+  r = memorymap_find(address);
+  if(r == NULL || !r->cacheable)
+    return NULL;
+
+  for(s = stats; s != NULL; s = s->next) {
+    if(s->r == r)
+      break;
+  }
+  if(s == NULL) {
+    s = calloc(1, sizeof(struct region_stats));
+    if(s == NULL)
+      return NULL;
+    s->r    = r;
+    s->next = stats;
+    stats   = s;
+  }
+  last_stats = s;
+  return s;
+}
+
+/****************************************************************************/
+static struct line *victim(struct cache *c, struct line *set) {
+  struct line *v = set;
+  uint32_t i;
+
+  for(i = 0; i < c->ways; i++) {
+    if(!set[i].valid)
+      return set+i;
+  }
+
+  if(c->replace == REPLACE_RANDOM) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return set + (random_state & (c->ways-1));
+  }
+
+  /* LRU and FIFO both throw out the oldest stamp */
+  for(i = 1; i < c->ways; i++) {
+    if(c->clock - set[i].stamp > c->clock - v->stamp)
+      v = set+i;
+  }
+  return v;
+}
+
+/****************************************************************************
+ * Look up an access that has just been made to memory with the given
+ * latency, returning how many cycles it really costs
+ ****************************************************************************/
+uint32_t cache_access(int which, uint32_t address, int write, uint32_t latency) {
+  struct cache *c = caches + which;
+  struct region_stats *s;
+  struct line *set, *l;
+  uint32_t block, tag, i, fill;
+
+  if(c->lines == NULL)
+    return latency;
+  s = region_stats(address);
+  if(s == NULL)
+    return latency;
+
+  c->clock++;
+  block = address >> c->line_shift;
+  tag   = block / c->sets;
+  set   = c->lines + (block & (c->sets-1)) * c->ways;
+
+  for(i = 0; i < c->ways; i++) {
+    l = set+i;
+    if(l->valid && l->tag == tag) {
+      s->hits[which][write]++;
+      if(c->replace == REPLACE_LRU)
+        l->stamp = c->clock;
+      if(write) {
+        if(c->write_back) {
+          l->dirty = 1;
+          return 0;
+        }
+        return latency;
+      }
+      return 0;
+    }
+  }
+
+  s->misses[which][write]++;
+  /* Write-through doesn't allocate on a store miss */
+  if(write && !c->write_back)
+    return latency;
+
+  /* A word at a time, less the cycle the access has already taken */
+  fill = c->miss ? c->miss : (c->line_size/4) * (1 + latency) - 1;
+
+  l = victim(c, set);
+  if(l->valid && l->dirty) {
+    l->owner->writebacks++;
+    fill += c->miss ? c->miss : (c->line_size/4) * (1 + l->owner->r->latency);
+  }
+  l->owner = s;
+  l->valid = 1;
+  l->dirty = write;
+  l->tag   = tag;
+  l->stamp = c->clock;
+  return fill;
+}
+
+/****************************************************************************/
+void cache_reset(void) {
+  int i;
+
+  for(i = 0; i < 2; i++) {
+    if(caches[i].lines != NULL)
+      memset(caches[i].lines, 0, caches[i].sets * caches[i].ways * sizeof(struct line));
+  }
+}
+
+/****************************************************************************/
+static void report_line(int which, const char *name, uint64_t hits, uint64_t misses) {
+  char buffer[150];
+  uint64_t total = hits + misses;
+
+  if(total == 0)
+    return;
+  snprintf(buffer, sizeof(buffer), "%s %-8.8s %llu hits, %llu misses (%.2f%% hit)",
+           cache_names[which], name, (unsigned long long)hits, (unsigned long long)misses,
+           100.0 * hits / total);
+  display_log(buffer);
+}
+
+/****************************************************************************
+ * Log the hits and misses for each region, and overall
+ ****************************************************************************/
+void cache_report(void) {
+  struct region_stats *s;
+  char buffer[150];
+  int which;
+
+  for(which = 0; which < 2; which++) {
+    uint64_t hits = 0, misses = 0;
+
+    if(caches[which].lines == NULL)
+      continue;
+    for(s = stats; s != NULL; s = s->next) {
+      uint64_t h = s->hits[which][0]   + s->hits[which][1];
+      uint64_t m = s->misses[which][0] + s->misses[which][1];
+      report_line(which, s->r->name, h, m);
+      hits   += h;
+      misses += m;
+    }
+    report_line(which, "total", hits, misses);
+  }
+
+  for(s = stats; s != NULL; s = s->next) {
+    if(s->writebacks == 0)
+      continue;
+    snprintf(buffer, sizeof(buffer), "D-cache %-8.8s %llu dirty lines written back",
+             s->r->name, (unsigned long long)s->writebacks);
+    display_log(buffer);
+  }
+}
+
+/****************************************************************************/
+void cache_finish(void) {
+  int i;
+
+  for(i = 0; i < 2; i++) {
+    free(caches[i].lines);
+    caches[i].lines = NULL;
+  }
+  while(stats != NULL) {
+    struct region_stats *s = stats;
+    stats = s->next;
+    free(s);
+  }
+  last_stats = NULL;
+}
+/****************************************************************************/
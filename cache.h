@@ -0,0 +1,12 @@
+#ifndef CACHE_H
+#define CACHE_H
+#define CACHE_I 0
+#define CACHE_D 1
+
+int      cache_configure(int which, const char *size, const char *options);
+int      cache_enabled(int which);
+uint32_t cache_access(int which, uint32_t address, int write, uint32_t latency);
+void     cache_reset(void);
+void     cache_report(void);
+void     cache_finish(void);
+#endif
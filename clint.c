@@ -15,30 +15,71 @@
 #include "region.h"
 #include "ram.h"
 #include "riscv.h"
+#include "event.h"
 #include "display.h"
+#include "log.h"
+
+/****************************************************************************
+ * Core Local Interruptor - software interrupt, and the machine timer.
+ * mtime is the CPU cycle count. Writing mtimecmp schedules an event for
+ * the cycle it will be reached, so there is no per-cycle compare.
+ ****************************************************************************/
+struct clint_data {
+  uint32_t msip;
+  uint64_t mtimecmp;
+  struct event timer;
+};
+
+/****************************************************************************/
+static void timer_expired(struct event *e, uint64_t now) {
+  riscv_set_irq(IRQ_M_TIMER, 1);
+}
+
+/****************************************************************************/
+static void update_timer(struct clint_data *data) {
+  if(data->mtimecmp <= riscv_cycles()) {
+    event_cancel(&data->timer);
+    riscv_set_irq(IRQ_M_TIMER, 1);
+  } else {
+    riscv_set_irq(IRQ_M_TIMER, 0);
+    event_schedule(&data->timer, data->mtimecmp);
+  }
+}
 
 /****************************************************************************/
 int CLINT_init(struct region *r) {
-  uint32_t *data;
+  struct clint_data *data;
 
   if(r->data != NULL) {
     display_log("CLINT already initialized");
     return 0;
   }
  
-  data = malloc(r->size);
+  data = malloc(sizeof(struct clint_data));
   if(data == NULL){
     return 0;
   }
+  memset(data, 0, sizeof(struct clint_data));
+  data->mtimecmp = EVENT_NEVER;
+  event_init(&data->timer, timer_expired, data);
   r->data = (void *)data;
-  memset(r->data, 0, r->size);
   display_log("Set up CLINT region");
   return 1;
 }
 
+/****************************************************************************/
+static uint32_t merge(uint32_t old, uint8_t mask, uint32_t value) {
+  uint32_t m = 0;
+  if(mask & 1) m |= 0x000000FF;
+  if(mask & 2) m |= 0x0000FF00;
+  if(mask & 4) m |= 0x00FF0000;
+  if(mask & 8) m |= 0xFF000000;
+  return (old & ~m) | (value & m);
+}
+
 /****************************************************************************/
 int CLINT_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
-   char buffer[100];
+   struct clint_data *data = r->data;
    if(address+4 > r->size) {
      fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
      return 0;
@@ -47,28 +88,31 @@ int CLINT_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value)
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory write 0x%08x\n", r->base+address);
    }
-   sprintf(buffer,"CLINT Wr address 0x%08x: 0x%08x", address, value);
-   display_log(buffer);
+   log_msg(LOG_CLINT, LOG_DEBUG, "CLINT Wr address 0x%08x: 0x%08x", address, value);
 
-   if(mask & 1) {
-      ((unsigned char *)r->data)[address+0] = value; 
-   }
-   if(mask & 2) {
-      ((unsigned char *)r->data)[address+1] = value>>8; 
-   }
-   if(mask & 4) {
-      ((unsigned char *)r->data)[address+2] = value>>16; 
-   }
-   if(mask & 8) {
-      ((unsigned char *)r->data)[address+3] = value>>24; 
+   switch(address) {
+     case 0x0000: // MSIP regs
+        data->msip = merge(data->msip, mask, value) & 1;
+        riscv_set_irq(IRQ_M_SOFT, data->msip);
+        break;
+     case 0x4000: // Timer Compare Reg
+        data->mtimecmp = (data->mtimecmp & 0xFFFFFFFF00000000ULL) | merge(data->mtimecmp, mask, value);
+        update_timer(data);
+        break;
+     case 0x4004:
+        data->mtimecmp = (data->mtimecmp & 0xFFFFFFFFULL) | ((uint64_t)merge(data->mtimecmp >> 32, mask, value) << 32);
+        update_timer(data);
+        break;
+     default:
+        /* mtime follows the cycle count, so can't be written */
+        break;
    }
    return 1;
 }
 
 /****************************************************************************/
 int CLINT_get(struct region *r, uint32_t address, uint32_t *value) {
-   uint32_t v = 0;
-   char buffer[100];
+   struct clint_data *data = r->data;
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory read 0x%08x\n", r->base+address);
      return 0;
@@ -79,20 +123,15 @@ int CLINT_get(struct region *r, uint32_t address, uint32_t *value) {
      return 0;
    }
 
-   v = ((unsigned char *)r->data)[address]; 
-   v = v + (((unsigned char *)r->data)[address+1] << 8); 
-   v = v + (((unsigned char *)r->data)[address+2] << 16); 
-   v = v + (((unsigned char *)r->data)[address+3] << 24); 
-
    switch(address) {
      case 0x0000: // MSIP regs
-        *value = v;
+        *value = data->msip;
 	break;
      case 0x4000: // Timer Compare Reg
-        *value = v;
+        *value = data->mtimecmp;
 	break;
      case 0x4004:
-        *value = v;
+        *value = data->mtimecmp >> 32;
 	break;
      case 0xBFF8:   // Cycle count
         *value = riscv_cycle_count_l();
@@ -101,40 +140,32 @@ int CLINT_get(struct region *r, uint32_t address, uint32_t *value) {
         *value = riscv_cycle_count_h();
 	break;
      default:
-        sprintf(buffer,"CLINT Rd of non-register address 0x%08x", address);
-        display_log(buffer);
+        log_msg(LOG_CLINT, LOG_WARN, "CLINT Rd of non-register address 0x%08x", address);
 	*value = 0;
 	return 1;
    }
      
-   sprintf(buffer,"CLINT Rd address 0x%08x: 0x%08x", address, v);
-   display_log(buffer);
+   log_msg(LOG_CLINT, LOG_DEBUG, "CLINT Rd address 0x%08x: 0x%08x", address, *value);
 
    return 1;
 }
 
 /****************************************************************************/
 void CLINT_dump(struct region *r) {
-   int i;
+   struct clint_data *data = r->data;
 
    printf("CLINT 0x%08x length 0x%08x\n", r->base, r->size);
-   for(i = 0; i < r->size && i < 4096; i++) {
-      if(i%32 == 0) {
-	 printf("%08x:", r->base+i);
-      }
-      printf(" %02x", ((unsigned char *)(r->data))[i]);
-      if(i%32 == 31)
-	 printf("\n");
-   }
-   if(i%32 != 0)
-     printf("\n");
+   printf("msip:     %08x\n", data->msip);
+   printf("mtimecmp: %016llx\n", (unsigned long long)data->mtimecmp);
 }
 /****************************************************************************/
 void CLINT_free(struct region *r) {
    char buffer[100];
    sprintf(buffer, "Releasing CLINT at 0x%08x", r->base);
    display_log(buffer);
-   if(r->data != NULL) 
+   if(r->data != NULL) {
+     event_cancel(&((struct clint_data *)r->data)->timer);
      free(r->data);
+   }
 }
 /****************************************************************************/
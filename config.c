@@ -0,0 +1,179 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "config.h"
+
+/****************************************************************************/
+static int is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/****************************************************************************
+ * Copy a double quoted word down over itself, undoing C style escapes.
+ * Returns a pointer to just past the closing quote, or NULL if the quote
+ * is never closed.
+ ****************************************************************************/
+static char *unquote(char *line) {
+  char *out = line;
+  char *in  = line+1;
+
+  while(*in != '"') {
+    char c = *in++;
+    if(c == '\0')
+      return NULL;
+    if(c == '\\') {
+      c = *in++;
+      switch(c) {
+        case 'n':  c = '\n'; break;
+        case 'r':  c = '\r'; break;
+        case 't':  c = '\t'; break;
+        case 'e':  c = 27;   break;
+        case 'x':  {
+                     char hex[3] = { 0, 0, 0 };
+                     if(isxdigit((unsigned char)in[0])) hex[0] = *in++;
+                     if(hex[0] && isxdigit((unsigned char)in[0])) hex[1] = *in++;
+                     c = (char)strtoul(hex, NULL, 16);
+                   }
+                   break;
+        case '\0': return NULL;
+      }
+    }
+    *out++ = c;
+  }
+  *out = '\0';
+  return in+1;
+}
+
+/****************************************************************************
+ * Break a line into whitespace separated words, in place. Anything after
+ * a '#' is a comment. A word in double quotes can hold spaces, '#' and
+ * escapes such as \n and \x1b. Returns the number of words found, or -1
+ * if there are too many or a quote is not closed.
+ ****************************************************************************/
+int config_split(char *line, char *argv[], int max_args) {
+  int argc = 0;
+
+  while(*line != '\0') {
+    while(is_space(*line))
+      line++;
+
+    if(*line == '\0' || *line == '#')
+      break;
+
+    if(argc == max_args)
+      return -1;
+    argv[argc++] = line;
+
+    if(*line == '"') {
+      line = unquote(line);
+      if(line == NULL)
+        return -1;
+      if(*line != '\0' && !is_space(*line) && *line != '#')
+        return -1;
+      continue;
+    }
+
+    while(*line != '\0' && *line != '#' && !is_space(*line))
+      line++;
+
+    if(*line == '#') {
+      *line = '\0';
+      break;
+    }
+    if(*line != '\0')
+      *line++ = '\0';
+  }
+  return argc;
+}
+
+/****************************************************************************
+ * Convert a number in decimal, hex (0x...) or octal, with an optional
+ * K or M suffix for sizes.
+ ****************************************************************************/
+int config_number64(const char *str, uint64_t *value) {
+  unsigned long long v;
+  char *end;
+
+  if(str == NULL || *str == '\0')
+    return 0;
+
+  v = strtoull(str, &end, 0);
+  if(end == str)
+    return 0;
+
+  switch(*end) {
+    case 'k': case 'K': v *= 1024;      end++; break;
+    case 'm': case 'M': v *= 1024*1024; end++; break;
+  }
+
+  if(*end != '\0')
+    return 0;
+
+  *value = v;
+  return 1;
+}
+
+/****************************************************************************/
+int config_number(const char *str, uint32_t *value) {
+  uint64_t v;
+
+  if(!config_number64(str, &v) || v > 0xFFFFFFFFULL)
+    return 0;
+
+  *value = (uint32_t)v;
+  return 1;
+}
+
+/****************************************************************************
+ * Look for "key=value" in a space separated option string. Returns 1 and
+ * copies the value into the buffer if the key is present.
+ ****************************************************************************/
+int config_option(const char *options, const char *key, char *value, int len) {
+  int key_len = strlen(key);
+
+  if(options == NULL)
+    return 0;
+
+  while(*options != '\0') {
+    const char *end;
+
+    while(is_space(*options))
+      options++;
+
+    end = options;
+    while(*end != '\0' && !is_space(*end))
+      end++;
+
+    if(strncmp(options, key, key_len) == 0 && options[key_len] == '=') {
+      int n = end - (options+key_len+1);
+      if(n >= len)
+        return 0;
+      memcpy(value, options+key_len+1, n);
+      value[n] = '\0';
+      return 1;
+    }
+    options = end;
+  }
+  return 0;
+}
+
+/****************************************************************************/
+int config_option_number(const char *options, const char *key, uint32_t *value) {
+  char buffer[32];
+
+  if(!config_option(options, key, buffer, sizeof(buffer)))
+    return 0;
+  return config_number(buffer, value);
+}
+/****************************************************************************/
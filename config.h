@@ -0,0 +1,9 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#define CONFIG_MAX_ARGS 32
+int config_split(char *line, char *argv[], int max_args);
+int config_number(const char *str, uint32_t *value);
+int config_number64(const char *str, uint64_t *value);
+int config_option(const char *options, const char *key, char *value, int len);
+int config_option_number(const char *options, const char *key, uint32_t *value);
+#endif
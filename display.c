@@ -13,6 +13,8 @@
 
 #include "display.h"
 #include "riscv.h"
+#include "log.h"
+#include "symbols.h"
 
 #define BORDER_PAIR   1
 #define INACTIVE_PAIR 2
@@ -28,11 +30,10 @@
 #define N_UART      6
 #define UART_SHOW   6
 #define UART_WIDTH 80
-FILE *log_file;
+#define LOG_WIDTH  80
 
-static char *log_lines[N_LOG];
-static int log_index = 0;
-static int log_changed = 1;
+static char log_lines[N_LOG][LOG_WIDTH+1];
+static uint32_t log_seen = ~0u;
 
 static char *trace_lines[N_TRACE];
 static int trace_index = 0;
@@ -44,6 +45,9 @@ static int uart_changed = 1;
 static int uart_cursor_x = 0;
 static int uart_cursor_y = 0;
 
+/* Running without the ncurses screen, e.g. from a test harness */
+static int no_display = 0;
+
 /*****************************************************************/
 static void update_reg(void) {
   int i;
@@ -57,15 +61,20 @@ static void update_reg(void) {
     printw(" r%02i %08X", i+16, riscv_reg(i+16));
   }
   move(1+i, 0);
-  printw("       pc %08X       ",riscv_pc());
+  if(symbols_count() > 0) {
+    char name[64];
+    symbols_format(riscv_pc(), name, sizeof(name));
+    printw("pc %08X %-13.13s", riscv_pc(), name);
+  } else {
+    printw("       pc %08X       ",riscv_pc());
+  }
 }
 
 /*****************************************************************/
 static void update_log(void) {
-  int i, index;
+  int i;
 
-  index = log_index-LOG_SHOW;
-  if(index < 0) index = 0;
+  log_seen = log_recent(&log_lines[0][0], N_LOG, LOG_WIDTH);
 
   move(18,0);
   attron(COLOR_PAIR(BORDER_PAIR));
@@ -73,12 +82,8 @@ static void update_log(void) {
   attron(COLOR_PAIR(ACTIVE_PAIR));
   for(i = 0; i < LOG_SHOW; i++) {
      move(19+i,0);
-     if(log_lines[index+i])
-       printw("%-80s", log_lines[index+i]);
-     else
-       printw("%-80s", "");
+     printw("%-80s", log_lines[N_LOG-LOG_SHOW+i]);
   }
-  log_changed = 0;
 }
 /*****************************************************************/
 static void update_trace(void) {
@@ -120,11 +125,13 @@ static void update_uart(void) {
 }
 
 /*****************************************************************/
-int display_start(void) {
+int display_start(int headless) {
   int i, maxx, maxy;
-  if(log_file == NULL) {
-    log_file = fopen("events.log","wb");
+  if(!log_start("events.log")) {
+    fprintf(stderr, "Unable to start logging\n");
+    return 0;
   }
+  no_display = headless;
   for(i = 0; i < N_TRACE; i++) {
     trace_lines[i] = malloc(TRACE_WIDTH+1);
     if(trace_lines[i] == NULL) {
@@ -145,6 +152,9 @@ int display_start(void) {
     uart_lines[i][UART_WIDTH] = 0;
   }
 
+  if(no_display)
+    return 1;
+
   /* This sets up the screen */
   if(initscr()==NULL) {
     return 0;
@@ -179,11 +189,19 @@ int display_start(void) {
   return 1;
 }
 
+/*****************************************************************/
+int display_headless(void) {
+  return no_display;
+}
+
 /*****************************************************************/
 void display_update(void) {
+  if(no_display)
+    return;
+
   update_reg();
 
-  if(log_changed) 
+  if(log_sequence() != log_seen)
     update_log();
 
   if(trace_changed) 
@@ -197,32 +215,7 @@ void display_update(void) {
 
 /*****************************************************************/
 void display_log(char *str) {
-  if(log_file != NULL) {
-    fprintf(log_file,"%s\n",str);
-  }
-  if(log_index == N_LOG) {
-    ////////////////////
-    // Free up a line 
-    ////////////////////
-    int i;
-    if(log_lines[0] != NULL)
-      free(log_lines[0]);
-    for(i = 1; i < N_LOG; i++) {
-      log_lines[i-1] = log_lines[i];
-    }	    
-    log_lines[N_LOG-1] = NULL;
-    log_index--;
-    log_changed = 1;
-  }  
-
-  log_lines[log_index] = malloc(strlen(str)+1);
-
-  if(log_lines[log_index] == NULL)
-    return;
-
-  log_changed = 1;
-  strcpy(log_lines[log_index],str);
-  log_index++;
+  log_msg(LOG_CORE, LOG_INFO, "%s", str);
 }
 
 /*****************************************************************/
@@ -259,7 +252,12 @@ void display_trace(char *str) {
 
 /*****************************************************************/
 void display_process_input(int *run, int *quit, int *trace, int *reset) {
-  int key = getch();
+  int key;
+
+  if(no_display)
+    return;
+
+  key = getch();
   switch(key) {
     case 'R':
        *reset = 1;
@@ -281,6 +279,11 @@ void display_process_input(int *run, int *quit, int *trace, int *reset) {
 /*****************************************************************/
 void display_uart_write(char c) {
 
+  if(no_display) {
+    putchar(c);
+    return;
+  }
+
   /* Only display printable characters */
   if(c > 27 && c < 127) {
     uart_lines[uart_cursor_y][uart_cursor_x] = c;
@@ -316,13 +319,13 @@ void display_uart_write(char c) {
 /*****************************************************************/
 void display_end(void) {
   int i;
-  if(log_file != NULL) {
-    fclose(log_file);
-    log_file = NULL;
-  }
+  log_finish();
   for(i = 0; i < N_TRACE; i++) {
     if(trace_lines[i] != NULL)
       free(trace_lines[i]);
   }
-  endwin();
+  if(no_display)
+    fflush(stdout);
+  else
+    endwin();
 }
@@ -0,0 +1,139 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include "event.h"
+#include "display.h"
+
+/****************************************************************************
+ * Events are kept in a binary min-heap ordered by the cycle they are due,
+ * so the CPU loop only has to compare the cycle count with event_deadline.
+ * Devices own their struct event (usually inside their region data) and
+ * the heap just holds pointers to them.
+ ****************************************************************************/
+#define EVENT_MAX (64)
+
+static struct event *heap[EVENT_MAX];
+static int heap_count = 0;
+
+uint64_t event_deadline = EVENT_NEVER;
+
+/****************************************************************************/
+static void heap_set(int i, struct event *e) {
+  heap[i] = e;
+  e->index = i;
+}
+
+/****************************************************************************/
+static void sift_up(int i) {
+  struct event *e = heap[i];
+
+  while(i > 0) {
+    int parent = (i-1)/2;
+    if(heap[parent]->when <= e->when)
+      break;
+    heap_set(i, heap[parent]);
+    i = parent;
+  }
+  heap_set(i, e);
+}
+
+/****************************************************************************/
+static void sift_down(int i) {
+  struct event *e = heap[i];
+
+  while(1) {
+    int child = 2*i+1;
+    if(child >= heap_count)
+      break;
+    if(child+1 < heap_count && heap[child+1]->when < heap[child]->when)
+      child++;
+    if(e->when <= heap[child]->when)
+      break;
+    heap_set(i, heap[child]);
+    i = child;
+  }
+  heap_set(i, e);
+}
+
+/****************************************************************************/
+static void update_deadline(void) {
+  event_deadline = heap_count > 0 ? heap[0]->when : EVENT_NEVER;
+}
+
+/****************************************************************************/
+void event_init(struct event *e, void (*func)(struct event *e, uint64_t now), void *data) {
+  e->when  = EVENT_NEVER;
+  e->func  = func;
+  e->data  = data;
+  e->index = -1;
+}
+
+/****************************************************************************/
+int event_pending(struct event *e) {
+  return e->index >= 0;
+}
+
+/****************************************************************************/
+void event_cancel(struct event *e) {
+  int i = e->index;
+
+  if(i < 0)
+    return;
+
+  e->index = -1;
+  heap_count--;
+  if(i != heap_count) {
+    heap_set(i, heap[heap_count]);
+    sift_up(i);
+    sift_down(i);
+  }
+  update_deadline();
+}
+
+/****************************************************************************
+ * (Re)schedule an event to fire when the cycle count reaches 'when'
+ ****************************************************************************/
+int event_schedule(struct event *e, uint64_t when) {
+  if(e->index >= 0) {
+    uint64_t old = e->when;
+    e->when = when;
+    if(when < old)
+      sift_up(e->index);
+    else
+      sift_down(e->index);
+    update_deadline();
+    return 1;
+  }
+
+  if(heap_count == EVENT_MAX) {
+    display_log("Event queue is full");
+    return 0;
+  }
+
+  e->when = when;
+  heap_set(heap_count, e);
+  heap_count++;
+  sift_up(heap_count-1);
+  update_deadline();
+  return 1;
+}
+
+/****************************************************************************
+ * Call everything that is due. Handlers may reschedule themselves.
+ ****************************************************************************/
+void event_run(uint64_t now) {
+  while(heap_count > 0 && heap[0]->when <= now) {
+    struct event *e = heap[0];
+    event_cancel(e);
+    e->func(e, now);
+  }
+}
+/****************************************************************************/
@@ -0,0 +1,20 @@
+#ifndef EVENT_H
+#define EVENT_H
+#define EVENT_NEVER (0xFFFFFFFFFFFFFFFFULL)
+
+struct event {
+  uint64_t when;
+  void   (*func)(struct event *e, uint64_t now);
+  void    *data;
+  int      index;
+};
+
+/* Cycle of the earliest scheduled event, or EVENT_NEVER */
+extern uint64_t event_deadline;
+
+void event_init(struct event *e, void (*func)(struct event *e, uint64_t now), void *data);
+int  event_schedule(struct event *e, uint64_t when);
+void event_cancel(struct event *e);
+int  event_pending(struct event *e);
+void event_run(uint64_t now);
+#endif
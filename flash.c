@@ -0,0 +1,353 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "region.h"
+#include "config.h"
+#include "flash.h"
+#include "display.h"
+
+/****************************************************************************
+ * A QSPI NOR flash (like the IS25LP128 on the HiFive1) backed by a host
+ * file. The file is mapped rather than read, so a large image is ready
+ * as soon as the mapping is made, and the pages are only read in as the
+ * guest touches them.
+ *
+ * The guest sees it two ways - as execute-in-place memory, which can be
+ * read but not written, and as a device on the QSPI controller taking
+ * the usual flash commands. Programs and erases change the mapping, and
+ * so the file, unless the region has writeback=off.
+ *
+ * Anything past the end of the file reads as erased (0xFF).
+ ****************************************************************************/
+#define FLASH_STATUS_WIP  0x01
+#define FLASH_STATUS_WEL  0x02
+
+#define CMD_WRITE_STATUS  0x01
+#define CMD_PAGE_PROGRAM  0x02
+#define CMD_READ          0x03
+#define CMD_WRITE_DISABLE 0x04
+#define CMD_READ_STATUS   0x05
+#define CMD_WRITE_ENABLE  0x06
+#define CMD_FAST_READ     0x0B
+#define CMD_ERASE_4K      0x20
+#define CMD_ERASE_32K     0x52
+#define CMD_CHIP_ERASE    0x60
+#define CMD_RESET_ENABLE  0x66
+#define CMD_READ_ID       0x9F
+#define CMD_RESET         0x99
+#define CMD_RELEASE_PD    0xAB
+#define CMD_POWER_DOWN    0xB9
+#define CMD_CHIP_ERASE2   0xC7
+#define CMD_ERASE_64K     0xD8
+
+static const uint8_t jedec_id[3] = { 0x9D, 0x60, 0x18 };
+
+struct flash_data {
+  uint8_t *map;
+  uint32_t mapped;
+  uint32_t size;
+  uint8_t  status;
+  uint8_t  powered_down;
+
+  /* State of the command in progress while selected */
+  uint8_t  selected;
+  uint8_t  cmd;
+  uint32_t count;
+  uint32_t addr;
+};
+
+/* The one flash chip, on the QSPI controller's chip select 0 */
+static struct flash_data *flash;
+
+/****************************************************************************/
+int FLASH_init(struct region *r) {
+  struct flash_data *data;
+  char fname[256];
+  char option[16];
+  char buffer[300];
+  struct stat st;
+  int shared = 1;
+  int fd;
+
+  if(r->data != NULL) {
+    display_log("FLASH already initialized");
+    return 0;
+  }
+  if(flash != NULL) {
+    display_log("Only one FLASH is supported");
+    return 0;
+  }
+
+  if(!config_option(r->options, "file", fname, sizeof(fname)))
+    sprintf(fname, "flash_%08x.bin", r->base);
+  if(config_option(r->options, "writeback", option, sizeof(option)) && strcmp(option, "off") == 0)
+    shared = 0;
+
+  data = malloc(sizeof(struct flash_data));
+  if(data == NULL)
+    return 0;
+  memset(data, 0, sizeof(struct flash_data));
+  data->size = r->size;
+
+  fd = open(fname, shared ? O_RDWR : O_RDONLY);
+  if(fd < 0) {
+    sprintf(buffer, "Unable to open FLASH file '%.64s'", fname);
+    display_log(buffer);
+    free(data);
+    return 0;
+  }
+
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    free(data);
+    return 0;
+  }
+  data->mapped = (st.st_size < r->size) ? st.st_size : r->size;
+
+  if(data->mapped > 0) {
+    /* A private mapping still lets the guest program it for this run */
+    data->map = mmap(NULL, data->mapped, PROT_READ | PROT_WRITE,
+                     shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if(data->map == MAP_FAILED) {
+      sprintf(buffer, "Unable to map FLASH file '%.64s'", fname);
+      display_log(buffer);
+      close(fd);
+      free(data);
+      return 0;
+    }
+  }
+  close(fd);
+
+  r->data = data;
+  flash = data;
+  sprintf(buffer, "Set up FLASH region from '%.64s' (%u bytes)", fname, data->mapped);
+  display_log(buffer);
+  return 1;
+}
+
+/****************************************************************************/
+static uint8_t read_byte(struct flash_data *data, uint32_t address) {
+  if(address < data->mapped)
+    return data->map[address];
+  return 0xFF;
+}
+
+/****************************************************************************/
+int FLASH_get(struct region *r, uint32_t address, uint32_t *value) {
+   struct flash_data *data = r->data;
+
+   if(address+4 > r->size) {
+     fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
+     return 0;
+   }
+
+   if(address+4 <= data->mapped) {
+     uint8_t *p = data->map + address;
+     *value = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+   } else {
+     *value = read_byte(data, address)
+            | (read_byte(data, address+1) << 8)
+            | (read_byte(data, address+2) << 16)
+            | ((uint32_t)read_byte(data, address+3) << 24);
+   }
+   return 1;
+}
+
+/****************************************************************************/
+int FLASH_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
+   char buffer[100];
+   sprintf(buffer, "Write to FLASH at 0x%08x ignored", r->base+address);
+   display_log(buffer);
+   return 1;
+}
+
+/****************************************************************************
+ * Used by the loader to put an image straight into the flash
+ ****************************************************************************/
+int FLASH_load(struct region *r, uint32_t address, const uint8_t *src, uint32_t len) {
+   struct flash_data *data = r->data;
+
+   if(address > data->mapped || len > data->mapped - address) {
+     display_log("Image is larger than the FLASH file");
+     return 0;
+   }
+   /* No source is a fill, e.g. an ELF's .bss */
+   if(src != NULL)
+     memcpy(data->map + address, src, len);
+   else
+     memset(data->map + address, 0, len);
+   return 1;
+}
+
+/****************************************************************************/
+static void program_byte(struct flash_data *data, uint32_t address, uint8_t value) {
+  address %= data->size;
+  /* NOR flash can only clear bits */
+  if(address < data->mapped)
+    data->map[address] &= value;
+}
+
+/****************************************************************************/
+static void erase(struct flash_data *data, uint32_t address, uint32_t len) {
+  uint32_t start = (address % data->size) & ~(len-1);
+  uint32_t end   = start + len;
+
+  if(end > data->mapped)
+    end = data->mapped;
+  if(start < end)
+    memset(data->map + start, 0xFF, end - start);
+}
+
+/****************************************************************************/
+void flash_select(void) {
+  if(flash == NULL)
+    return;
+  flash->selected = 1;
+  flash->count    = 0;
+  flash->addr     = 0;
+}
+
+/****************************************************************************
+ * Erases happen when the chip select goes high after the whole command,
+ * and any write or erase uses up the write enable
+ ****************************************************************************/
+void flash_deselect(void) {
+  struct flash_data *data = flash;
+  int wel;
+
+  if(data == NULL || !data->selected)
+    return;
+  data->selected = 0;
+  if(data->count == 0)
+    return;
+
+  wel = data->status & FLASH_STATUS_WEL;
+  switch(data->cmd) {
+    case CMD_ERASE_4K:
+      if(wel && data->count == 4) erase(data, data->addr, 4*1024);
+      break;
+    case CMD_ERASE_32K:
+      if(wel && data->count == 4) erase(data, data->addr, 32*1024);
+      break;
+    case CMD_ERASE_64K:
+      if(wel && data->count == 4) erase(data, data->addr, 64*1024);
+      break;
+    case CMD_CHIP_ERASE:
+    case CMD_CHIP_ERASE2:
+      if(wel) erase(data, 0, data->size);
+      break;
+    case CMD_WRITE_ENABLE:
+      data->status |= FLASH_STATUS_WEL;
+      return;
+    case CMD_POWER_DOWN:
+      data->powered_down = 1;
+      return;
+    case CMD_RELEASE_PD:
+      data->powered_down = 0;
+      return;
+    default:
+      break;
+  }
+
+  switch(data->cmd) {
+    case CMD_PAGE_PROGRAM:
+    case CMD_WRITE_STATUS:
+    case CMD_WRITE_DISABLE:
+    case CMD_ERASE_4K:
+    case CMD_ERASE_32K:
+    case CMD_ERASE_64K:
+    case CMD_CHIP_ERASE:
+    case CMD_CHIP_ERASE2:
+      data->status &= ~FLASH_STATUS_WEL;
+      break;
+  }
+}
+
+/****************************************************************************
+ * Clock one byte through the chip, returning what it sends back
+ ****************************************************************************/
+uint8_t flash_transfer(uint8_t out) {
+  struct flash_data *data = flash;
+  uint32_t n;
+  uint8_t in = 0xFF;
+
+  if(data == NULL || !data->selected)
+    return 0xFF;
+
+  n = data->count++;
+  if(n == 0) {
+    data->cmd = out;
+    return 0xFF;
+  }
+
+  /* Only a release from power down gets a response */
+  if(data->powered_down && data->cmd != CMD_RELEASE_PD)
+    return 0xFF;
+
+  switch(data->cmd) {
+    case CMD_READ_ID:
+      if(n <= 3)
+        in = jedec_id[n-1];
+      break;
+    case CMD_READ_STATUS:
+      in = data->status;
+      break;
+    case CMD_READ:
+    case CMD_FAST_READ:
+    case CMD_PAGE_PROGRAM:
+    case CMD_ERASE_4K:
+    case CMD_ERASE_32K:
+    case CMD_ERASE_64K:
+      if(n <= 3) {
+        data->addr = (data->addr << 8) | out;
+      } else if(data->cmd == CMD_READ || (data->cmd == CMD_FAST_READ && n > 4)) {
+        in = read_byte(data, data->addr % data->size);
+        data->addr++;
+      } else if(data->cmd == CMD_PAGE_PROGRAM && (data->status & FLASH_STATUS_WEL)) {
+        /* Wraps around within the 256 byte page */
+        program_byte(data, (data->addr & ~0xFF) | ((data->addr + n - 4) & 0xFF), out);
+      }
+      break;
+  }
+  return in;
+}
+
+/****************************************************************************/
+void FLASH_dump(struct region *r) {
+   struct flash_data *data = r->data;
+   printf("FLASH 0x%08x length 0x%08x, %u bytes from file, status %02x\n",
+          r->base, r->size, data->mapped, data->status);
+}
+
+/****************************************************************************/
+void FLASH_free(struct region *r) {
+   struct flash_data *data = r->data;
+   char buffer[100];
+   sprintf(buffer, "Releasing FLASH at 0x%08x", r->base);
+   display_log(buffer);
+   if(data != NULL) {
+     if(data->map != NULL) {
+       msync(data->map, data->mapped, MS_SYNC);
+       munmap(data->map, data->mapped);
+     }
+     if(flash == data)
+       flash = NULL;
+     free(data);
+   }
+}
+/****************************************************************************/
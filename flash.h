@@ -0,0 +1,12 @@
+#ifndef FLASH_H
+#define FLASH_H
+int  FLASH_init(struct region *r);
+int  FLASH_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value);
+int  FLASH_get(struct region *r, uint32_t address, uint32_t *value);
+int  FLASH_load(struct region *r, uint32_t address, const uint8_t *src, uint32_t len);
+void FLASH_dump(struct region *r);
+void FLASH_free(struct region *r);
+void flash_select(void);
+void flash_deselect(void);
+uint8_t flash_transfer(uint8_t out);
+#endif
@@ -13,30 +13,159 @@
 #include <memory.h>
 #include "region.h"
 #include "ram.h"
+#include "config.h"
+#include "plic.h"
+#include "riscv.h"
+#include "vcd.h"
 #include "display.h"
+#include "log.h"
+
+#define GPIO_INPUT_VAL  0x00
+#define GPIO_INPUT_EN   0x04
+#define GPIO_OUTPUT_EN  0x08
+#define GPIO_OUTPUT_VAL 0x0C
+#define GPIO_RISE_IE    0x18
+#define GPIO_RISE_IP    0x1C
+#define GPIO_FALL_IE    0x20
+#define GPIO_FALL_IP    0x24
+#define GPIO_HIGH_IE    0x28
+#define GPIO_HIGH_IP    0x2C
+#define GPIO_LOW_IE     0x30
+#define GPIO_LOW_IP     0x34
+#define GPIO_OUT_XOR    0x40
+
+/****************************************************************************
+ * Nothing outside drives the pins, so an input that is also an output
+ * reads back what is being driven, and the rest read as low. Each pin
+ * is its own interrupt source at the PLIC, starting from irq=
+ ****************************************************************************/
+struct gpio_data {
+  uint8_t *regs;
+  uint32_t irq;
+  uint32_t irq_lines;
+
+  /* Waveform capture of the driven pins, if vcd= was given */
+  struct vcd *vcd;
+  uint32_t vcd_value;
+  uint32_t vcd_enable;
+};
+
+/****************************************************************************/
+static uint32_t reg_get(struct gpio_data *data, uint32_t address) {
+  uint8_t *p = data->regs + address;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/****************************************************************************/
+static void reg_put(struct gpio_data *data, uint32_t address, uint32_t v) {
+  uint8_t *p = data->regs + address;
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+/****************************************************************************
+ * Work out the new pin levels, latch any edges and levels into the
+ * pending registers and pass changes in the interrupt lines to the PLIC
+ ****************************************************************************/
+static void update_pins(struct gpio_data *data) {
+  uint32_t old  = reg_get(data, GPIO_INPUT_VAL);
+  uint32_t pins = reg_get(data, GPIO_OUTPUT_EN)
+                & (reg_get(data, GPIO_OUTPUT_VAL) ^ reg_get(data, GPIO_OUT_XOR))
+                & reg_get(data, GPIO_INPUT_EN);
+  uint32_t lines, changed;
+  int i;
+
+  if(data->vcd != NULL) {
+    uint32_t enable = reg_get(data, GPIO_OUTPUT_EN);
+    uint32_t value  = (reg_get(data, GPIO_OUTPUT_VAL) ^ reg_get(data, GPIO_OUT_XOR)) & enable;
+    if(value != data->vcd_value || enable != data->vcd_enable) {
+      vcd_sample(data->vcd, riscv_cycles(), value, enable);
+      data->vcd_value  = value;
+      data->vcd_enable = enable;
+    }
+  }
+
+  reg_put(data, GPIO_INPUT_VAL, pins);
+  reg_put(data, GPIO_RISE_IP, reg_get(data, GPIO_RISE_IP) | (pins & ~old));
+  reg_put(data, GPIO_FALL_IP, reg_get(data, GPIO_FALL_IP) | (~pins & old));
+  reg_put(data, GPIO_HIGH_IP, reg_get(data, GPIO_HIGH_IP) | pins);
+  reg_put(data, GPIO_LOW_IP,  reg_get(data, GPIO_LOW_IP)  | ~pins);
+
+  if(data->irq == 0)
+    return;
+
+  lines = (reg_get(data, GPIO_RISE_IP) & reg_get(data, GPIO_RISE_IE))
+        | (reg_get(data, GPIO_FALL_IP) & reg_get(data, GPIO_FALL_IE))
+        | (reg_get(data, GPIO_HIGH_IP) & reg_get(data, GPIO_HIGH_IE))
+        | (reg_get(data, GPIO_LOW_IP)  & reg_get(data, GPIO_LOW_IE));
+  changed = lines ^ data->irq_lines;
+  data->irq_lines = lines;
+
+  while(changed) {
+    i = __builtin_ctz(changed);
+    plic_set_source(data->irq + i, (lines >> i) & 1);
+    changed &= changed-1;
+  }
+}
 
 /****************************************************************************/
 int GPIO_init(struct region *r) {
-  uint32_t *data;
+  struct gpio_data *data;
+  char fname[256];
+  char buffer[300];
 
   if(r->data != NULL) {
     display_log("GPIO already initialized");
     return 0;
   }
+  if(r->size < GPIO_OUT_XOR+4) {
+    display_log("GPIO region is too small");
+    return 0;
+  }
  
-  data = malloc(r->size);
+  data = malloc(sizeof(struct gpio_data));
   if(data == NULL){
     return 0;
   }
+  memset(data, 0, sizeof(struct gpio_data));
+  data->regs = malloc(r->size);
+  if(data->regs == NULL){
+    free(data);
+    return 0;
+  }
+  memset(data->regs, 0, r->size);
+  config_option_number(r->options, "irq", &data->irq);
+
+  if(config_option(r->options, "vcd", fname, sizeof(fname))) {
+    data->vcd = vcd_open(fname, r->name, 32);
+    if(data->vcd == NULL) {
+      sprintf(buffer, "Unable to open VCD file '%.64s'", fname);
+      display_log(buffer);
+      free(data->regs);
+      free(data);
+      return 0;
+    }
+  }
+  update_pins(data);
   r->data = (void *)data;
-  memset(r->data, 0, r->size);
   display_log("Set up GPIO region");
   return 1;
 }
 
+/****************************************************************************
+ * The bits a store with this byte mask writes
+ ****************************************************************************/
+static uint32_t lanes(uint8_t mask) {
+  uint32_t m = 0;
+  if(mask & 1) m |= 0x000000FF;
+  if(mask & 2) m |= 0x0000FF00;
+  if(mask & 4) m |= 0x00FF0000;
+  if(mask & 8) m |= 0xFF000000;
+  return m;
+}
+
 /****************************************************************************/
 int GPIO_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
-   char buffer[100];
+   struct gpio_data *data = r->data;
    if(address+4 > r->size) {
      fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
      return 0;
@@ -45,28 +174,42 @@ int GPIO_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory write 0x%08x\n", r->base+address);
    }
-   sprintf(buffer,"GPIO Wr address 0x%08x: 0x%08x", address, value);
-   display_log(buffer);
+   log_msg(LOG_GPIO, LOG_DEBUG, "GPIO Wr address 0x%08x: 0x%08x", address, value);
 
-   if(mask & 1) {
-      ((unsigned char *)r->data)[address+0] = value; 
-   }
-   if(mask & 2) {
-      ((unsigned char *)r->data)[address+1] = value>>8; 
-   }
-   if(mask & 4) {
-      ((unsigned char *)r->data)[address+2] = value>>16; 
-   }
-   if(mask & 8) {
-      ((unsigned char *)r->data)[address+3] = value>>24; 
+   switch(address) {
+     case GPIO_INPUT_VAL:
+       /* Read only */
+       break;
+     case GPIO_RISE_IP:
+     case GPIO_FALL_IP:
+     case GPIO_HIGH_IP:
+     case GPIO_LOW_IP:
+       /* Write one to clear, only in the bytes written */
+       reg_put(data, address, reg_get(data, address) & ~(value & lanes(mask)));
+       break;
+     default:
+       if(mask & 1) {
+          data->regs[address+0] = value; 
+       }
+       if(mask & 2) {
+          data->regs[address+1] = value>>8; 
+       }
+       if(mask & 4) {
+          data->regs[address+2] = value>>16; 
+       }
+       if(mask & 8) {
+          data->regs[address+3] = value>>24; 
+       }
+       break;
    }
+   update_pins(data);
    return 1;
 }
 
 /****************************************************************************/
 int GPIO_get(struct region *r, uint32_t address, uint32_t *value) {
+   struct gpio_data *data = r->data;
    uint32_t v = 0;
-   char buffer[100];
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory read 0x%08x\n", r->base+address);
      return 0;
@@ -77,10 +220,10 @@ int GPIO_get(struct region *r, uint32_t address, uint32_t *value) {
      return 0;
    }
 
-   v = ((unsigned char *)r->data)[address]; 
-   v = v + (((unsigned char *)r->data)[address+1] << 8); 
-   v = v + (((unsigned char *)r->data)[address+2] << 16); 
-   v = v + (((unsigned char *)r->data)[address+3] << 24); 
+   v = data->regs[address]; 
+   v = v + (data->regs[address+1] << 8); 
+   v = v + (data->regs[address+2] << 16); 
+   v = v + (data->regs[address+3] << 24); 
 
    switch(address) {
      case 0x00:
@@ -120,14 +263,14 @@ int GPIO_get(struct region *r, uint32_t address, uint32_t *value) {
    }
    *value = v;
      
-   sprintf(buffer,"GPIO Rd address 0x%08x: 0x%08x", address, v);
-   display_log(buffer);
+   log_msg(LOG_GPIO, LOG_DEBUG, "GPIO Rd address 0x%08x: 0x%08x", address, v);
 
    return 1;
 }
 
 /****************************************************************************/
 void GPIO_dump(struct region *r) {
+   struct gpio_data *data = r->data;
    int i;
 
    printf("GPIO 0x%08x length 0x%08x\n", r->base, r->size);
@@ -135,7 +278,7 @@ void GPIO_dump(struct region *r) {
       if(i%32 == 0) {
 	 printf("%08x:", r->base+i);
       }
-      printf(" %02x", ((unsigned char *)(r->data))[i]);
+      printf(" %02x", data->regs[i]);
       if(i%32 == 31)
 	 printf("\n");
    }
@@ -147,7 +290,17 @@ void GPIO_free(struct region *r) {
    char buffer[100];
    sprintf(buffer, "Releasing GPIO at 0x%08x", r->base);
    display_log(buffer);
-   if(r->data != NULL) 
-     free(r->data);
+   if(r->data != NULL) {
+     struct gpio_data *data = r->data;
+     if(data->vcd != NULL) {
+       uint64_t stalls = vcd_close(data->vcd);
+       if(stalls > 0) {
+         sprintf(buffer, "GPIO VCD writer fell behind %llu times", (unsigned long long)stalls);
+         display_log(buffer);
+       }
+     }
+     free(data->regs);
+     free(data);
+   }
 }
 /****************************************************************************/
@@ -0,0 +1,274 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "hotspot.h"
+#include "region.h"
+#include "memorymap.h"
+#include "symbols.h"
+#include "display.h"
+
+/****************************************************************************
+ * Per instruction execution and stall counts.
+ *
+ * Every region code can run from gets a table with a counter set for each
+ * word. The tables are split into chunks that are only allocated when
+ * code in them first runs, so a big flash costs little if only a small
+ * part of it is used.
+ *
+ * At exit the addresses are sorted by the cycles spent on them and
+ * written out, along with the totals for each function when there are
+ * symbols.
+ ****************************************************************************/
+#define HOTSPOT_CHUNK_SHIFT 10
+#define HOTSPOT_CHUNK_SIZE  (1 << HOTSPOT_CHUNK_SHIFT)
+#define HOTSPOT_CAUSES      3
+
+struct counts {
+  uint64_t exec;
+  uint64_t stall[HOTSPOT_CAUSES];
+};
+
+struct code_region {
+  uint32_t base;
+  uint32_t size;
+  uint32_t n_chunks;
+  struct counts **chunks;
+};
+
+struct hot {
+  uint32_t address;
+  uint64_t cycles;
+  struct counts *c;
+};
+
+int hotspot_active = 0;
+
+static struct code_region *regions;
+static int n_regions;
+static struct code_region *last;
+static struct counts dropped;
+
+static const char *cause_names[HOTSPOT_CAUSES] = { "fetch", "load", "store" };
+
+/****************************************************************************/
+static void add_region(struct region *r, void *arg) {
+  struct code_region *n = realloc(regions, (n_regions+1) * sizeof(struct code_region));
+  if(n == NULL)
+    return;
+  regions = n;
+  n = regions + n_regions;
+  n->base     = r->base;
+  n->size     = r->size;
+  n->n_chunks = ((r->size+3)/4 + HOTSPOT_CHUNK_SIZE - 1) >> HOTSPOT_CHUNK_SHIFT;
+  n->chunks   = calloc(n->n_chunks, sizeof(struct counts *));
+  if(n->chunks != NULL)
+    n_regions++;
+}
+
+/****************************************************************************/
+int hotspot_start(void) {
+  memorymap_code_regions(add_region, NULL);
+  if(n_regions == 0)
+    return 0;
+  hotspot_active = 1;
+  return 1;
+}
+
+/****************************************************************************
+ * The counters for pc, or somewhere harmless if it isn't in a code region
+ ****************************************************************************/
+static struct counts *counts(uint32_t pc) {
+  uint32_t word, chunk;
+
+  if(last == NULL || pc - last->base >= last->size) {
+    int i;
+    last = NULL;
+    for(i = 0; i < n_regions; i++) {
+      if(pc - regions[i].base < regions[i].size) {
+        last = regions+i;
+        break;
+      }
+    }
+    if(last == NULL)
+      return &dropped;
+  }
+
+  word  = (pc - last->base) >> 2;
+  chunk = word >> HOTSPOT_CHUNK_SHIFT;
+  if(last->chunks[chunk] == NULL) {
+    last->chunks[chunk] = calloc(HOTSPOT_CHUNK_SIZE, sizeof(struct counts));
+    if(last->chunks[chunk] == NULL)
+      return &dropped;
+  }
+  return last->chunks[chunk] + (word & (HOTSPOT_CHUNK_SIZE-1));
+}
+
+/****************************************************************************/
+void hotspot_exec(uint32_t pc) {
+  counts(pc)->exec++;
+}
+
+/****************************************************************************/
+void hotspot_stall(uint32_t pc, int cause) {
+  counts(pc)->stall[cause]++;
+}
+
+/****************************************************************************/
+static uint64_t cycles(struct counts *c) {
+  return c->exec + c->stall[HOTSPOT_FETCH] + c->stall[HOTSPOT_LOAD] + c->stall[HOTSPOT_STORE];
+}
+
+/****************************************************************************/
+static int compare(const void *a, const void *b) {
+  const struct hot *ha = a, *hb = b;
+
+  if(ha->cycles != hb->cycles)
+    return ha->cycles > hb->cycles ? -1 : 1;
+  return ha->address < hb->address ? -1 : 1;
+}
+
+/****************************************************************************/
+static void write_line(FILE *f, const char *name, struct counts *c, uint64_t total) {
+  uint64_t n = cycles(c);
+  int i;
+
+  fprintf(f, "%-32.32s %12llu", name, (unsigned long long)c->exec);
+  for(i = 0; i < HOTSPOT_CAUSES; i++)
+    fprintf(f, " %12llu", (unsigned long long)c->stall[i]);
+  fprintf(f, " %12llu %6.2f%%\n", (unsigned long long)n, total ? 100.0 * n / total : 0.0);
+}
+
+/****************************************************************************/
+static void write_header(FILE *f, const char *what) {
+  int i;
+
+  fprintf(f, "%-32s %12s", what, "executed");
+  for(i = 0; i < HOTSPOT_CAUSES; i++)
+    fprintf(f, " %6s stall", cause_names[i]);
+  fprintf(f, " %12s %7s\n", "cycles", "share");
+}
+
+/****************************************************************************
+ * Everything that ran, by address, then by function
+ ****************************************************************************/
+int hotspot_write(const char *fname) {
+  struct hot *list = NULL;
+  uint64_t total = 0;
+  char buffer[300];
+  int n = 0, max = 0, i;
+  FILE *f;
+
+  if(!hotspot_active)
+    return 0;
+
+  f = fopen(fname, "w");
+  if(f == NULL) {
+    snprintf(buffer, sizeof(buffer), "Unable to open hot-spot report '%s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  /* Gather up every address that used any cycles, in address order */
+  for(i = 0; i < n_regions; i++) {
+    uint32_t ch, w;
+    for(ch = 0; ch < regions[i].n_chunks; ch++) {
+      struct counts *c = regions[i].chunks[ch];
+      if(c == NULL)
+        continue;
+      for(w = 0; w < HOTSPOT_CHUNK_SIZE; w++) {
+        uint64_t n_cycles = cycles(c+w);
+        if(n_cycles == 0)
+          continue;
+        if(n == max) {
+          struct hot *l = realloc(list, (max ? 2*max : 1024) * sizeof(struct hot));
+          if(l == NULL) {
+            free(list);
+            fclose(f);
+            return 0;
+          }
+          list = l;
+          max = max ? 2*max : 1024;
+        }
+        list[n].address = regions[i].base + ((ch << HOTSPOT_CHUNK_SHIFT) + w) * 4;
+        list[n].cycles  = n_cycles;
+        list[n].c       = c+w;
+        total += n_cycles;
+        n++;
+      }
+    }
+  }
+
+  /* Functions are contiguous, so can be totalled before sorting */
+  if(symbols_count() > 0) {
+    const char *current = NULL;
+    struct counts sum;
+
+    write_header(f, "function");
+    memset(&sum, 0, sizeof(sum));
+    for(i = 0; i <= n; i++) {
+      const char *name = (i < n) ? symbols_lookup(list[i].address, NULL) : NULL;
+      int j;
+
+      if(i == n || name != current) {
+        if(i > 0 && cycles(&sum) > 0)
+          write_line(f, current ? current : "(unknown)", &sum, total);
+        memset(&sum, 0, sizeof(sum));
+        current = name;
+      }
+      if(i == n)
+        break;
+      sum.exec += list[i].c->exec;
+      for(j = 0; j < HOTSPOT_CAUSES; j++)
+        sum.stall[j] += list[i].c->stall[j];
+    }
+    fprintf(f, "\n");
+  }
+
+  qsort(list, n, sizeof(struct hot), compare);
+  write_header(f, "address");
+  for(i = 0; i < n; i++) {
+    char name[64];
+    symbols_format(list[i].address, name, sizeof(name));
+    snprintf(buffer, sizeof(buffer), "%08x %s", list[i].address, name);
+    write_line(f, buffer, list[i].c, total);
+  }
+  free(list);
+  fclose(f);
+
+  snprintf(buffer, sizeof(buffer), "Hot-spot report of %i addresses written to '%s'", n, fname);
+  display_log(buffer);
+  if(cycles(&dropped) > 0) {
+    snprintf(buffer, sizeof(buffer), "%llu cycles were spent outside of code regions",
+             (unsigned long long)cycles(&dropped));
+    display_log(buffer);
+  }
+  return 1;
+}
+
+/****************************************************************************/
+void hotspot_finish(void) {
+  int i;
+  uint32_t ch;
+
+  for(i = 0; i < n_regions; i++) {
+    for(ch = 0; ch < regions[i].n_chunks; ch++)
+      free(regions[i].chunks[ch]);
+    free(regions[i].chunks);
+  }
+  free(regions);
+  regions   = NULL;
+  n_regions = 0;
+  last      = NULL;
+  hotspot_active = 0;
+}
+/****************************************************************************/
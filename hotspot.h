@@ -0,0 +1,16 @@
+#ifndef HOTSPOT_H
+#define HOTSPOT_H
+/* Why the CPU was stalled */
+#define HOTSPOT_FETCH 0
+#define HOTSPOT_LOAD  1
+#define HOTSPOT_STORE 2
+
+/* Set while counting, so the CPU only calls in when it is wanted */
+extern int hotspot_active;
+
+int  hotspot_start(void);
+void hotspot_exec(uint32_t pc);
+void hotspot_stall(uint32_t pc, int cause);
+int  hotspot_write(const char *fname);
+void hotspot_finish(void);
+#endif
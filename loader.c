@@ -0,0 +1,458 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "region.h"
+#include "config.h"
+#include "loader.h"
+#include "memorymap.h"
+#include "symbols.h"
+#include "display.h"
+
+/****************************************************************************
+ * Map a whole file read-only. Returns 0 if it can't be, while an empty
+ * file is fine and gives a NULL map of size 0.
+ ****************************************************************************/
+static int map_file(char *fname, const uint8_t **map, size_t *size) {
+  struct stat st;
+  void *m;
+  int fd;
+
+  *map  = NULL;
+  *size = 0;
+  fd = open(fname, O_RDONLY);
+  if(fd < 0)
+    return 0;
+
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    return 0;
+  }
+  if(st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+
+  m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED)
+    return 0;
+
+  *map  = m;
+  *size = st.st_size;
+  return 1;
+}
+
+/****************************************************************************
+ * Original text format - one 32-bit word in hex per line. The file is
+ * mapped so there is no per-character stdio, and whole 8 digit words are
+ * decoded with SSE2 where it is available. Short words (or a leading
+ * space) go through the scalar decoder.
+ ****************************************************************************/
+static int hex_value(char c) {
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+/****************************************************************************/
+static const char *skip_line(const char *p, const char *end) {
+  p = memchr(p, '\n', end-p);
+  return p == NULL ? end : p+1;
+}
+
+/****************************************************************************/
+static const char *hex_word_scalar(const char *p, const char *end, uint32_t *word) {
+  uint32_t d = 0;
+  int i, v;
+
+  if(*p != ' ') {
+    v = hex_value(*p);
+    if(v < 0)
+      return NULL;
+    d = v;
+  }
+  p++;
+
+  for(i = 0; i < 7 && p < end; i++, p++) {
+    v = hex_value(*p);
+    if(v >= 0) {
+      d = d*16 + v;
+    } else if(*p == ' ' || *p == '\t' || *p == '\n') {
+      break;
+    } else {
+      return NULL;
+    }
+  }
+  *word = d;
+  return skip_line(p, end);
+}
+
+#ifdef __SSE2__
+/****************************************************************************/
+static int hex_word_sse2(const char *p, uint32_t *word) {
+  __m128i c, lower, digit, alpha, nib;
+
+  c     = _mm_loadl_epi64((const __m128i *)p);
+  lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  digit = _mm_and_si128(_mm_cmpgt_epi8(c,     _mm_set1_epi8('0'-1)),
+                        _mm_cmplt_epi8(c,     _mm_set1_epi8('9'+1)));
+  alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a'-1)),
+                        _mm_cmplt_epi8(lower, _mm_set1_epi8('f'+1)));
+
+  /* All 8 characters have to be hex digits */
+  if((_mm_movemask_epi8(_mm_or_si128(digit, alpha)) & 0xFF) != 0xFF)
+    return 0;
+
+  nib = _mm_or_si128(_mm_and_si128(digit,    _mm_sub_epi8(c,     _mm_set1_epi8('0'))),
+                     _mm_andnot_si128(digit, _mm_sub_epi8(lower, _mm_set1_epi8('a'-10))));
+
+  /* Pairs of nibbles into bytes - the first character is the high nibble */
+  nib = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib, _mm_set1_epi16(0x00FF)), 4),
+                     _mm_srli_epi16(nib, 8));
+  nib = _mm_packus_epi16(nib, nib);
+
+  /* The first byte is the most significant */
+  *word = __builtin_bswap32((uint32_t)_mm_cvtsi128_si32(nib));
+  return 1;
+}
+#endif
+
+/****************************************************************************/
+static int decode_hex(struct region *r, const char *p, const char *end, uint32_t *length) {
+  uint32_t *data;
+  uint32_t a = 0;
+
+  data = (uint32_t *)(r->data);
+
+  while(p < end) {
+    uint32_t d;
+
+    while(p < end && (*p == '\n' || *p == '\r'))
+      p++;
+    if(p == end)
+      break;
+
+#ifdef __SSE2__
+    if(end - p >= 8 && hex_word_sse2(p, &d)) {
+      p = skip_line(p+8, end);
+    } else
+#endif
+    {
+      p = hex_word_scalar(p, end, &d);
+      if(p == NULL) {
+        display_log("unexpected characters in file");
+        return 0;
+      }
+    }
+
+    if(a*4+3 >= r->size) {
+      display_log("Too much data for memory region");
+      return 0;
+    }
+    data[a] = d;
+    a++;
+  }
+  *length = a*4;
+  return 1;
+}
+
+/****************************************************************************
+ * Decoded hex images are cached in a binary sidecar file next to the text.
+ * The cache is keyed on the text file's size, modification time and a hash
+ * of the whole text (cheap next to decoding it), and the payload carries its
+ * own hash so a truncated or damaged cache is ignored.
+ ****************************************************************************/
+#define HEX_CACHE_MAGIC  "RVHEXC1"
+
+struct hex_cache_header {
+  char     magic[8];
+  uint64_t text_size;
+  int64_t  text_mtime_sec;
+  int64_t  text_mtime_nsec;
+  uint64_t text_hash;
+  uint64_t data_hash;
+  uint32_t length;
+  uint32_t reserved;
+};
+
+/****************************************************************************/
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t len) {
+  while(len-- > 0) {
+    h ^= *p++;
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+/****************************************************************************/
+static void hex_cache_key(struct hex_cache_header *h, struct stat *st, const uint8_t *text, size_t size) {
+  uint64_t hash = fnv1a(0xCBF29CE484222325ULL, text, size);
+
+  memset(h, 0, sizeof(struct hex_cache_header));
+  memcpy(h->magic, HEX_CACHE_MAGIC, sizeof(h->magic));
+  h->text_size       = st->st_size;
+  h->text_mtime_sec  = st->st_mtim.tv_sec;
+  h->text_mtime_nsec = st->st_mtim.tv_nsec;
+  h->text_hash       = hash;
+}
+
+/****************************************************************************/
+static int hex_cache_read(struct region *r, char *cache_name, struct hex_cache_header *key) {
+  const struct hex_cache_header *h;
+  const uint8_t *map;
+  size_t size = 0;
+  int rtn = 0;
+
+  if(!map_file(cache_name, &map, &size) || map == NULL)
+    return 0;
+
+  h = (const struct hex_cache_header *)map;
+  if(size >= sizeof(struct hex_cache_header)
+     && memcmp(h->magic, key->magic, sizeof(h->magic)) == 0
+     && h->text_size       == key->text_size
+     && h->text_mtime_sec  == key->text_mtime_sec
+     && h->text_mtime_nsec == key->text_mtime_nsec
+     && h->text_hash       == key->text_hash
+     && h->length          == size - sizeof(struct hex_cache_header)
+     && h->length          <= r->size
+     && h->data_hash == fnv1a(0xCBF29CE484222325ULL, map+sizeof(struct hex_cache_header), h->length)) {
+    rtn = memorymap_load(r->base, map+sizeof(struct hex_cache_header), h->length);
+  }
+
+  munmap((void *)map, size);
+  return rtn;
+}
+
+/****************************************************************************/
+static void hex_cache_write(struct region *r, char *cache_name, struct hex_cache_header *h, uint32_t length) {
+  char tmp_name[300];
+  FILE *f;
+
+  h->length    = length;
+  h->data_hash = fnv1a(0xCBF29CE484222325ULL, r->data, length);
+
+  /* Write to a temporary file and rename, so readers never see half a cache */
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%i", cache_name, (int)getpid());
+  f = fopen(tmp_name, "wb");
+  if(f == NULL)
+    return;
+
+  if(fwrite(h, sizeof(struct hex_cache_header), 1, f) != 1
+     || fwrite(r->data, 1, length, f) != length) {
+    fclose(f);
+    unlink(tmp_name);
+    return;
+  }
+  if(fclose(f) != 0 || rename(tmp_name, cache_name) != 0)
+    unlink(tmp_name);
+}
+
+/****************************************************************************/
+static int load_hex(struct region *r, char *fname, const uint8_t *text, size_t size) {
+  struct hex_cache_header key;
+  char cache_name[280];
+  char option[8];
+  uint32_t length;
+  struct stat st;
+  int use_cache;
+
+  /* An empty file is fine, there is nothing to load */
+  if(text == NULL)
+    return 1;
+
+  use_cache = !config_option(r->options, "cache", option, sizeof(option)) || strcmp(option, "off") != 0;
+  use_cache = use_cache && stat(fname, &st) == 0;
+  use_cache = use_cache && snprintf(cache_name, sizeof(cache_name), "%s.cache", fname) < sizeof(cache_name);
+
+  if(use_cache) {
+    hex_cache_key(&key, &st, text, size);
+    if(hex_cache_read(r, cache_name, &key)) {
+      display_log("Using cached binary image");
+      return 1;
+    }
+  }
+
+  if(!decode_hex(r, (const char *)text, (const char *)text+size, &length))
+    return 0;
+
+  if(use_cache)
+    hex_cache_write(r, cache_name, &key, length);
+  return 1;
+}
+
+/****************************************************************************/
+static int is_elf(const uint8_t *map, size_t size) {
+  return size >= sizeof(Elf32_Ehdr) && memcmp(map, ELFMAG, SELFMAG) == 0;
+}
+
+/****************************************************************************
+ * Copy the PT_LOAD segments of an RV32 ELF file into memory. If 'only' is
+ * not NULL then just the parts of segments inside that region are loaded,
+ * so a region can take its part of a larger image.
+ ****************************************************************************/
+static int load_elf_segments(const uint8_t *map, size_t size, struct region *only, uint32_t *entry) {
+  const Elf32_Ehdr *eh = (const Elf32_Ehdr *)map;
+  char buffer[128];
+  int i;
+
+  if(eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_ident[EI_DATA] != ELFDATA2LSB) {
+    display_log("ELF file is not 32-bit little endian");
+    return 0;
+  }
+  if(eh->e_machine != EM_RISCV) {
+    display_log("ELF file is not for RISC-V");
+    return 0;
+  }
+  if(eh->e_phentsize != sizeof(Elf32_Phdr) || eh->e_phoff + (size_t)eh->e_phnum * sizeof(Elf32_Phdr) > size) {
+    display_log("ELF program headers are corrupt");
+    return 0;
+  }
+
+  for(i = 0; i < eh->e_phnum; i++) {
+    const Elf32_Phdr *ph = (const Elf32_Phdr *)(map + eh->e_phoff) + i;
+    uint64_t start = ph->p_paddr, end = start + ph->p_memsz;
+    uint32_t addr, skip, filesz, memsz;
+
+    if(ph->p_type != PT_LOAD || ph->p_memsz == 0)
+      continue;
+
+    if((size_t)ph->p_offset + ph->p_filesz > size || ph->p_filesz > ph->p_memsz) {
+      display_log("ELF segment lies outside of the file");
+      return 0;
+    }
+
+    /* Clip to the region, logging anything that falls outside it */
+    if(only != NULL) {
+      uint64_t base = only->base, top = base + only->size;
+      if(end <= base || start >= top)
+        continue;
+      if(start < base || end > top) {
+        sprintf(buffer, "ELF segment 0x%08x length 0x%08x clipped to region '%.32s'",
+                ph->p_paddr, ph->p_memsz, only->name);
+        display_log(buffer);
+        start = start < base ? base : start;
+        end   = end   > top  ? top  : end;
+      }
+    }
+
+    addr   = start;
+    skip   = start - ph->p_paddr;
+    memsz  = end - start;
+    filesz = ph->p_filesz > skip ? ph->p_filesz - skip : 0;
+    if(filesz > memsz)
+      filesz = memsz;
+
+    /* The file contents, then zeros for any .bss part */
+    if(!memorymap_load(addr, map + ph->p_offset + skip, filesz))
+      return 0;
+    if(!memorymap_load(addr + filesz, NULL, memsz - filesz))
+      return 0;
+
+    sprintf(buffer, "Loaded segment 0x%08x length 0x%08x", addr, memsz);
+    display_log(buffer);
+  }
+
+  /* Not all images have symbols, so this is allowed to fail */
+  symbols_load_elf(map, size);
+
+  if(entry != NULL)
+    *entry = eh->e_entry;
+  return 1;
+}
+
+/****************************************************************************/
+static int has_extension(char *fname, char *ext) {
+  size_t n = strlen(fname), e = strlen(ext);
+  return n > e && strcmp(fname+n-e, ext) == 0;
+}
+
+/****************************************************************************
+ * Load the initial contents of a ROM or RAM region. ELF files and raw
+ * binaries (*.bin) are mapped and copied in bulk, anything else is taken
+ * to be the one-word-per-line hex format.
+ ****************************************************************************/
+int loader_load_region(struct region *r, char *fname) {
+  const uint8_t *map;
+  char buffer[128];
+  size_t size = 0;
+  int rtn;
+
+  if(access(fname, R_OK) != 0) {
+    sprintf(buffer, "File '%.64s' not present", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  if(!map_file(fname, &map, &size)) {
+    sprintf(buffer, "Unable to map '%.64s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  if(map != NULL && is_elf(map, size)) {
+    rtn = load_elf_segments(map, size, r, NULL);
+  } else if(map != NULL && has_extension(fname, ".bin")) {
+    if(size > r->size) {
+      display_log("Too much data for memory region");
+      rtn = 0;
+    } else {
+      rtn = memorymap_load(r->base, map, size);
+    }
+  } else {
+    rtn = load_hex(r, fname, map, size);
+  }
+
+  if(map != NULL)
+    munmap((void *)map, size);
+
+  sprintf(buffer, "%s '%.64s'", rtn ? "Loaded" : "Unable to load", fname);
+  display_log(buffer);
+  return rtn;
+}
+
+/****************************************************************************
+ * Load a whole ELF executable into whatever regions it targets, returning
+ * the entry point.
+ ****************************************************************************/
+int loader_load_elf(char *fname, uint32_t *entry) {
+  const uint8_t *map;
+  size_t size;
+  int rtn;
+
+  if(!map_file(fname, &map, &size)) {
+    char buffer[128];
+    sprintf(buffer, "Unable to open ELF file '%.64s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  if(map == NULL || !is_elf(map, size)) {
+    display_log("Not an ELF file");
+    if(map != NULL)
+      munmap((void *)map, size);
+    return 0;
+  }
+
+  rtn = load_elf_segments(map, size, NULL, entry);
+  munmap((void *)map, size);
+  return rtn;
+}
+/****************************************************************************/
@@ -0,0 +1,5 @@
+#ifndef LOADER_H
+#define LOADER_H
+int loader_load_region(struct region *r, char *fname);
+int loader_load_elf(char *fname, uint32_t *entry);
+#endif
@@ -0,0 +1,497 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "log.h"
+
+/****************************************************************************
+ * Leveled logging that stays off the CPU loop.
+ *
+ * Every message has a subsystem and a level. Messages above
+ * LOG_COMPILE_LEVEL are removed by the compiler, and those above the
+ * subsystem's runtime level cost one compare.
+ *
+ * A message that does get through isn't formatted there and then. The
+ * format string (which has to be a literal) and the raw arguments are
+ * copied into a ring of fixed size records, and a writer thread does the
+ * printf work and writes events.log. Strings are copied into the record,
+ * as they may not live that long.
+ *
+ * Any thread may log, so each slot in the ring has a turn counter saying
+ * whether it is free or filled for a given lap of the ring. Producers
+ * claim slots by bumping the head with a compare and swap, the writer
+ * is the only consumer.
+ *
+ * The last few messages at LOG_INFO or above are kept for the screen.
+ ****************************************************************************/
+#define LOG_RING_BITS   12
+#define LOG_RING_SIZE   (1 << LOG_RING_BITS)
+#define LOG_RING_MASK   (LOG_RING_SIZE - 1)
+#define LOG_MAX_ARGS    8
+#define LOG_TEXT_SIZE   256
+#define LOG_LINE_SIZE   512
+#define LOG_SPEC_SIZE   16
+#define LOG_RECENT      16
+
+#define ARG_NONE   0
+#define ARG_BAD    1
+#define ARG_INT    2
+#define ARG_LONG   3
+#define ARG_LLONG  4
+#define ARG_SIZE   5
+#define ARG_DOUBLE 6
+#define ARG_STRING 7
+#define ARG_PTR    8
+
+union log_arg {
+  unsigned long long u;
+  double      d;
+  void       *p;
+};
+
+struct log_record {
+  uint64_t      turn;
+  const char   *fmt;
+  uint8_t       sub;
+  uint8_t       level;
+  uint8_t       n_args;
+  uint16_t      text_used;
+  union log_arg args[LOG_MAX_ARGS];
+  char          text[LOG_TEXT_SIZE];
+};
+
+static const char *subsystem_names[LOG_SUBSYSTEMS] = {
+  "core", "cpu", "mem", "uart", "gpio", "spi",
+  "flash", "clint", "plic", "prci", "script"
+};
+
+static const char *level_names[] = {
+  "error", "warn", "info", "debug", "trace"
+};
+
+uint8_t log_levels[LOG_SUBSYSTEMS];
+
+static struct log_record ring[LOG_RING_SIZE];
+static uint64_t head;     /* Next slot to be claimed by a producer */
+static uint64_t tail;     /* Only touched by the writer */
+static uint64_t stalls;
+
+static FILE     *log_file;
+static pthread_t        thread;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wake = PTHREAD_COND_INITIALIZER;
+static int      running;
+static int      stop;
+
+/* Kept for the screen, under the lock */
+static char     recent[LOG_RECENT][LOG_LINE_SIZE];
+static uint32_t recent_count;
+
+/****************************************************************************
+ * Copy one conversion out of the format into spec, leaving *p after it.
+ * Returns what sort of argument it takes.
+ ****************************************************************************/
+static int conversion(const char **p, char *spec) {
+  const char *s = *p;
+  int len = 0, i = 0;
+
+  spec[i++] = *s++;
+  while(*s != '\0' && strchr("-+ #0123456789.", *s) != NULL && i < LOG_SPEC_SIZE-4)
+    spec[i++] = *s++;
+
+  if(*s == 'h') {
+    spec[i++] = *s++;
+    if(*s == 'h')
+      spec[i++] = *s++;
+  } else if(*s == 'l') {
+    spec[i++] = *s++;
+    len = ARG_LONG;
+    if(*s == 'l') {
+      spec[i++] = *s++;
+      len = ARG_LLONG;
+    }
+  } else if(*s == 'z') {
+    spec[i++] = *s++;
+    len = ARG_SIZE;
+  }
+
+  spec[i++] = *s;
+  spec[i] = '\0';
+  if(*s == '\0') {
+    *p = s;
+    return ARG_BAD;
+  }
+  *p = s+1;
+
+  switch(*s) {
+    case '%':
+      return ARG_NONE;
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+      return len ? len : ARG_INT;
+    case 'c':
+      return ARG_INT;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+      return ARG_DOUBLE;
+    case 's':
+      return ARG_STRING;
+    case 'p':
+      return ARG_PTR;
+  }
+  return ARG_BAD;
+}
+
+/****************************************************************************/
+static void wake_writer(void) {
+  pthread_mutex_lock(&lock);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+/****************************************************************************
+ * Claim the next slot, waiting for the writer if the ring is full
+ ****************************************************************************/
+static struct log_record *claim(uint64_t *pos) {
+  uint64_t p = __atomic_load_n(&head, __ATOMIC_RELAXED);
+
+  for(;;) {
+    struct log_record *rec = &ring[p & LOG_RING_MASK];
+    uint64_t turn = 2 * (p >> LOG_RING_BITS);
+
+    if(__atomic_load_n(&rec->turn, __ATOMIC_ACQUIRE) == turn) {
+      if(__atomic_compare_exchange_n(&head, &p, p+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos = p;
+        return rec;
+      }
+    } else {
+      uint64_t now = __atomic_load_n(&head, __ATOMIC_RELAXED);
+      if(now == p) {
+        /* Full - nothing can be done until the writer is going */
+        if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+          return NULL;
+        __atomic_add_fetch(&stalls, 1, __ATOMIC_RELAXED);
+        wake_writer();
+        sched_yield();
+      }
+      p = now;
+    }
+  }
+}
+
+/****************************************************************************/
+void log_post(int sub, int level, const char *fmt, ...) {
+  struct log_record *rec;
+  char spec[LOG_SPEC_SIZE];
+  const char *p = fmt;
+  uint64_t pos;
+  va_list ap;
+
+  rec = claim(&pos);
+  if(rec == NULL)
+    return;
+
+  rec->fmt       = fmt;
+  rec->sub       = sub;
+  rec->level     = level;
+  rec->n_args    = 0;
+  rec->text_used = 0;
+
+  va_start(ap, fmt);
+  while(*p != '\0' && rec->n_args < LOG_MAX_ARGS) {
+    union log_arg *a = &rec->args[rec->n_args];
+    int kind;
+
+    if(*p != '%') {
+      p++;
+      continue;
+    }
+    kind = conversion(&p, spec);
+    if(kind == ARG_NONE)
+      continue;
+    if(kind == ARG_BAD)
+      break;
+
+    switch(kind) {
+      case ARG_INT:    a->u = va_arg(ap, unsigned int);       break;
+      case ARG_LONG:   a->u = va_arg(ap, unsigned long);      break;
+      case ARG_LLONG:  a->u = va_arg(ap, unsigned long long); break;
+      case ARG_SIZE:   a->u = va_arg(ap, size_t);             break;
+      case ARG_DOUBLE: a->d = va_arg(ap, double);             break;
+      case ARG_PTR:    a->p = va_arg(ap, void *);             break;
+      case ARG_STRING: {
+          const char *s = va_arg(ap, const char *);
+          int room = LOG_TEXT_SIZE - rec->text_used - 1;
+          int len;
+
+          if(s == NULL)
+            s = "(null)";
+          len = strlen(s);
+          if(len > room)
+            len = room;
+          memcpy(rec->text + rec->text_used, s, len);
+          rec->text[rec->text_used + len] = '\0';
+          a->u = rec->text_used;
+          /* Once full, later strings share the last terminator */
+          rec->text_used += len;
+          if(rec->text_used < LOG_TEXT_SIZE-1)
+            rec->text_used++;
+        }
+        break;
+    }
+    rec->n_args++;
+  }
+  va_end(ap);
+
+  __atomic_store_n(&rec->turn, 2 * (pos >> LOG_RING_BITS) + 1, __ATOMIC_RELEASE);
+
+  /* Give the writer a nudge when the ring is half full */
+  if(((pos+1) & (LOG_RING_SIZE/2 - 1)) == 0)
+    wake_writer();
+}
+
+/****************************************************************************
+ * Turn a record back into text, one conversion at a time
+ ****************************************************************************/
+static void format_record(struct log_record *rec, char *out) {
+  char spec[LOG_SPEC_SIZE];
+  const char *p = rec->fmt;
+  int used = 0, n_args = 0;
+
+  while(*p != '\0' && used < LOG_LINE_SIZE-1) {
+    union log_arg *a = &rec->args[n_args];
+    int room = LOG_LINE_SIZE - used;
+    int kind, n = 0;
+
+    if(*p != '%') {
+      out[used++] = *p++;
+      continue;
+    }
+    kind = conversion(&p, spec);
+    if(kind == ARG_NONE) {
+      out[used++] = '%';
+      continue;
+    }
+    if(kind == ARG_BAD || n_args == rec->n_args)
+      break;
+    n_args++;
+
+    switch(kind) {
+      case ARG_INT:    n = snprintf(out+used, room, spec, (unsigned int)a->u);  break;
+      case ARG_LONG:   n = snprintf(out+used, room, spec, (unsigned long)a->u); break;
+      case ARG_LLONG:  n = snprintf(out+used, room, spec, a->u);                break;
+      case ARG_SIZE:   n = snprintf(out+used, room, spec, (size_t)a->u);        break;
+      case ARG_DOUBLE: n = snprintf(out+used, room, spec, a->d);                break;
+      case ARG_PTR:    n = snprintf(out+used, room, spec, a->p);                break;
+      case ARG_STRING: n = snprintf(out+used, room, spec, rec->text + a->u);    break;
+    }
+    if(n > 0)
+      used += (n < room) ? n : room-1;
+  }
+  out[used] = '\0';
+}
+
+/****************************************************************************/
+static void write_record(struct log_record *rec) {
+  char line[LOG_LINE_SIZE];
+
+  format_record(rec, line);
+  if(log_file != NULL)
+    fprintf(log_file, "%s\n", line);
+
+  if(rec->level <= LOG_INFO) {
+    pthread_mutex_lock(&lock);
+    strcpy(recent[recent_count % LOG_RECENT], line);
+    __atomic_store_n(&recent_count, recent_count+1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+/****************************************************************************
+ * Write out everything that has been posted, returns 0 if there was none
+ ****************************************************************************/
+static int drain(void) {
+  int done = 0;
+
+  for(;;) {
+    struct log_record *rec = &ring[tail & LOG_RING_MASK];
+    uint64_t turn = 2 * (tail >> LOG_RING_BITS);
+
+    if(__atomic_load_n(&rec->turn, __ATOMIC_ACQUIRE) != turn+1)
+      return done;
+    write_record(rec);
+    __atomic_store_n(&rec->turn, turn+2, __ATOMIC_RELEASE);
+    tail++;
+    done = 1;
+  }
+}
+
+/****************************************************************************/
+static void *writer(void *arg) {
+  for(;;) {
+    struct timespec ts;
+
+    if(drain())
+      continue;
+    if(__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+      break;
+    if(log_file != NULL)
+      fflush(log_file);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 10000000;
+    if(ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&lock);
+    if(!stop)
+      pthread_cond_timedwait(&wake, &lock, &ts);
+    pthread_mutex_unlock(&lock);
+  }
+  drain();
+  return NULL;
+}
+
+/****************************************************************************
+ * Open the log file and start the writer. Anything logged before this
+ * is held in the ring until now.
+ ****************************************************************************/
+int log_start(const char *fname) {
+  int i;
+
+  if(running)
+    return 1;
+
+  for(i = 0; i < LOG_SUBSYSTEMS; i++)
+    log_levels[i] = LOG_INFO;
+
+  log_file = fopen(fname, "wb");
+  if(log_file != NULL)
+    setvbuf(log_file, NULL, _IOFBF, 1 << 16);
+
+  stop = 0;
+  if(pthread_create(&thread, NULL, writer, NULL) != 0) {
+    if(log_file != NULL)
+      fclose(log_file);
+    log_file = NULL;
+    return 0;
+  }
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/****************************************************************************/
+static int level_number(const char *name, int len) {
+  int i;
+
+  if(len == 1 && name[0] >= '0' && name[0] <= '4')
+    return name[0] - '0';
+  for(i = 0; i < (int)(sizeof(level_names)/sizeof(level_names[0])); i++) {
+    if(strlen(level_names[i]) == len && strncmp(level_names[i], name, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/****************************************************************************
+ * Set the runtime levels from something like "warn,uart=debug,clint=trace".
+ * A level on its own applies to every subsystem.
+ ****************************************************************************/
+int log_configure(const char *spec) {
+  while(*spec != '\0') {
+    const char *end = strchr(spec, ',');
+    const char *eq;
+    int len, level, i;
+
+    if(end == NULL)
+      end = spec + strlen(spec);
+    len = end - spec;
+    eq  = memchr(spec, '=', len);
+
+    if(eq == NULL) {
+      level = level_number(spec, len);
+      if(level < 0)
+        return 0;
+      for(i = 0; i < LOG_SUBSYSTEMS; i++)
+        log_levels[i] = level;
+    } else {
+      level = level_number(eq+1, end-eq-1);
+      if(level < 0)
+        return 0;
+      for(i = 0; i < LOG_SUBSYSTEMS; i++) {
+        if(strlen(subsystem_names[i]) == eq-spec && strncmp(subsystem_names[i], spec, eq-spec) == 0)
+          break;
+      }
+      if(i == LOG_SUBSYSTEMS)
+        return 0;
+      log_levels[i] = level;
+    }
+    spec = (*end == ',') ? end+1 : end;
+  }
+  return 1;
+}
+
+/****************************************************************************
+ * Changes whenever there is a new line for the screen
+ ****************************************************************************/
+uint32_t log_sequence(void) {
+  return __atomic_load_n(&recent_count, __ATOMIC_ACQUIRE);
+}
+
+/****************************************************************************
+ * Copy the last n screen lines, oldest first, into n buffers of width+1
+ ****************************************************************************/
+uint32_t log_recent(char *lines, int n, int width) {
+  uint32_t count;
+  int i;
+
+  pthread_mutex_lock(&lock);
+  count = recent_count;
+  for(i = 0; i < n; i++) {
+    char *line = lines + i*(width+1);
+    int age = n - i;
+
+    if(age > LOG_RECENT || age > count) {
+      line[0] = '\0';
+    } else {
+      strncpy(line, recent[(count - age) % LOG_RECENT], width);
+      line[width] = '\0';
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+/****************************************************************************/
+void log_finish(void) {
+  if(!running)
+    return;
+
+  pthread_mutex_lock(&lock);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+
+  if(log_file != NULL) {
+    if(stalls)
+      fprintf(log_file, "Logging fell behind %llu times\n", (unsigned long long)stalls);
+    fclose(log_file);
+    log_file = NULL;
+  }
+}
+/****************************************************************************/
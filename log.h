@@ -0,0 +1,47 @@
+#ifndef LOG_H
+#define LOG_H
+#include <stdint.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+/* Anything more detailed than this isn't even compiled in */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+enum log_subsystem {
+  LOG_CORE,
+  LOG_CPU,
+  LOG_MEM,
+  LOG_UART,
+  LOG_GPIO,
+  LOG_SPI,
+  LOG_FLASH,
+  LOG_CLINT,
+  LOG_PLIC,
+  LOG_PRCI,
+  LOG_SCRIPT,
+  LOG_SUBSYSTEMS
+};
+
+extern uint8_t log_levels[LOG_SUBSYSTEMS];
+
+#define log_enabled(sub, level) \
+  ((level) <= LOG_COMPILE_LEVEL && (level) <= log_levels[sub])
+
+/* The format must be a string literal, it is only looked at later */
+#define log_msg(sub, level, ...) \
+  do { if(log_enabled(sub, level)) log_post(sub, level, __VA_ARGS__); } while(0)
+
+int  log_start(const char *fname);
+int  log_configure(const char *spec);
+void log_post(int sub, int level, const char *fmt, ...)
+       __attribute__((format(printf, 3, 4)));
+uint32_t log_sequence(void);
+uint32_t log_recent(char *lines, int n, int width);
+void log_finish(void);
+#endif
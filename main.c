@@ -10,30 +10,144 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <signal.h>
 #include "riscv.h"
 #include "memory.h"
 #include "memorymap.h"
 #include "display.h"
+#include "event.h"
+#include "region.h"
+#include "loader.h"
+#include "script.h"
+#include "log.h"
+#include "profile.h"
+#include "hotspot.h"
 
+static volatile sig_atomic_t interrupted = 0;
+
+/****************************************************************************/
+static void on_signal(int sig) {
+  interrupted = 1;
+}
+
+/****************************************************************************/
+static void usage(char *name) {
+  fprintf(stderr,"Usage: %s [-n] [-m machine_file] [-e elf_file] [-s script] [-D dirty_report] [-l levels] [-p profile] [-H hotspots]\n", name);
+  fprintf(stderr,"  -n        No display - run straight away until the CPU stops\n");
+  fprintf(stderr,"  -m file   Load the memory map from a machine description\n");
+  fprintf(stderr,"  -e file   Load an RV32 ELF executable and start at its entry point\n");
+  fprintf(stderr,"  -s file   Drive the console UART from a script, and exit with its exit code\n");
+  fprintf(stderr,"  -D file   Write the list of memory pages written by the guest at exit\n");
+  fprintf(stderr,"  -H file   Count cycles and stalls for each instruction, writing the hot spots to file at exit\n");
+  fprintf(stderr,"  -p file   Profile the guest, writing folded call stacks to file at exit\n");
+  fprintf(stderr,"  -l levels Log levels, e.g. 'debug' or 'warn,uart=debug,clint=trace'\n");
+}
+
+/****************************************************************************/
 int main(int argc, char *argv[]) {
   int run = 1, quit = 0, trace = 1, reset = 0;
+  char *machine_file = NULL;
+  char *elf_file = NULL;
+  char *dirty_file = NULL;
+  char *script_file = NULL;
+  char *log_spec = NULL;
+  char *profile_file = NULL;
+  char *hotspot_file = NULL;
+  int headless = 0;
+  int exit_code = 0;
+  int c;
+
+  while((c = getopt(argc, argv, "nm:e:s:D:l:p:H:")) != -1) {
+    switch(c) {
+      case 'n':
+        headless = 1;
+        break;
+      case 'm':
+        machine_file = optarg;
+        break;
+      case 'e':
+        elf_file = optarg;
+        break;
+      case 's':
+        script_file = optarg;
+        break;
+      case 'D':
+        dirty_file = optarg;
+        break;
+      case 'l':
+        log_spec = optarg;
+        break;
+      case 'p':
+        profile_file = optarg;
+        break;
+      case 'H':
+        hotspot_file = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
 
-  if(!display_start()) {
+  if(!display_start(headless)) {
     fprintf(stderr,"Unable to initialise display\n");
     return 0;
   }
 
-  if(!memory_initialise()) {
-    return 0;
+  if(log_spec != NULL && !log_configure(log_spec)) {
+    display_end();
+    fprintf(stderr,"Log levels '%s' not understood\n", log_spec);
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* Loaded first so the console UART knows to take input from it */
+  if(script_file != NULL && !script_load(script_file)) {
+    display_end();
+    fprintf(stderr,"Unable to load script '%s' - see events.log\n", script_file);
+    return 1;
+  }
+
+  if(!memory_initialise(machine_file)) {
+    display_end();
+    fprintf(stderr,"Unable to initialise memory - see events.log\n");
+    return 1;
   }
   display_log("Memory inisitalised");
 
+  if(hotspot_file != NULL && !hotspot_start()) {
+    display_end();
+    fprintf(stderr,"Unable to start counting hot spots - no code regions?\n");
+    return 1;
+  }
+
+  if(elf_file != NULL) {
+    uint32_t entry;
+    if(!loader_load_elf(elf_file, &entry)) {
+      display_end();
+      fprintf(stderr,"Unable to load '%s' - see events.log\n", elf_file);
+      return 1;
+    }
+    riscv_set_reset_pc(entry);
+  }
+
   if(!riscv_initialise()) {
     return 0;
   }
+  if(profile_file != NULL && !profile_start()) {
+    display_end();
+    fprintf(stderr,"Unable to start the profiler\n");
+    return 1;
+  }
   display_log("RISC-V initalised");
   riscv_reset();
-  display_log("Press SPACE to run a sigle instruction, or 'r' to run. 'q' to quit");
+  if(headless) {
+    signal(SIGINT,  on_signal);
+    signal(SIGTERM, on_signal);
+    run = 2;
+  } else {
+    display_log("Press SPACE to run a sigle instruction, or 'r' to run. 'q' to quit");
+  }
 
   while(!quit) {
     if(run) {
@@ -46,12 +160,50 @@ int main(int argc, char *argv[]) {
     }
     display_update();
     display_process_input(&run, &quit, &trace, &reset);
+
+    /* Asleep with nothing scheduled to wake it, so don't spin */
+    if(run && riscv_waiting() && event_deadline == EVENT_NEVER)
+      usleep(10000);
     if(reset) {
       riscv_reset();
       reset = 0;
     }
+    if(script_file != NULL && script_finished(&exit_code))
+      quit = 1;
+    /* With no keyboard to restart it, stopping is the end of the run */
+    if(headless && (!run || interrupted))
+      quit = 1;
   }
   riscv_dump();
+
+  /* A script that never reached a decision counts as a failure */
+  if(script_file != NULL && !script_finished(&exit_code)) {
+    display_log("Run stopped before the script finished");
+    exit_code = 1;
+  }
+  script_finish();
+
+  if(dirty_file != NULL) {
+    FILE *f = fopen(dirty_file, "w");
+    if(f == NULL)
+      display_log("Unable to open dirty page report");
+    memorymap_dirty_report(f);
+    if(f != NULL)
+      fclose(f);
+  } else {
+    memorymap_dirty_report(NULL);
+  }
+
+  if(profile_file != NULL) {
+    profile_write(profile_file);
+    profile_finish();
+  }
+
+  if(hotspot_file != NULL) {
+    hotspot_write(hotspot_file);
+    hotspot_finish();
+  }
+
   riscv_finish();
   display_log("RISC-V shutdown");
   memory_finish();
@@ -59,5 +211,5 @@ int main(int argc, char *argv[]) {
   display_update();
   display_end();
   
-  return 0;
+  return exit_code;
 }
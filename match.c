@@ -0,0 +1,185 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "match.h"
+
+/****************************************************************************
+ * Look for many strings at once in a stream of characters (Aho-Corasick).
+ *
+ * The patterns are put into a trie, then the trie is turned into a full
+ * state machine - every state has a next state for every character - so
+ * each character costs one table lookup however many patterns there are.
+ * Each state also knows the longest pattern ending there and the next
+ * state down its chain of suffixes that also ends a pattern.
+ ****************************************************************************/
+struct matcher {
+  int      n_states;
+  int      max_states;
+  int      n_patterns;
+  int      built;
+  int      state;
+  int    (*next)[256];
+  int     *fail;
+  int     *output;   /* Pattern ending in this state, or -1 */
+  int     *dict;     /* Next suffix state with an output, or -1 */
+};
+
+/****************************************************************************/
+static int new_state(struct matcher *m) {
+  int i;
+
+  if(m->n_states == m->max_states) {
+    int max = m->max_states ? m->max_states * 2 : 64;
+    void *n, *f, *o, *d;
+
+    n = realloc(m->next,   max * sizeof(*m->next));
+    if(n != NULL) m->next = n;
+    f = realloc(m->fail,   max * sizeof(int));
+    if(f != NULL) m->fail = f;
+    o = realloc(m->output, max * sizeof(int));
+    if(o != NULL) m->output = o;
+    d = realloc(m->dict,   max * sizeof(int));
+    if(d != NULL) m->dict = d;
+    if(n == NULL || f == NULL || o == NULL || d == NULL)
+      return -1;
+    m->max_states = max;
+  }
+
+  for(i = 0; i < 256; i++)
+    m->next[m->n_states][i] = -1;
+  m->fail[m->n_states]   = 0;
+  m->output[m->n_states] = -1;
+  m->dict[m->n_states]   = -1;
+  return m->n_states++;
+}
+
+/****************************************************************************/
+struct matcher *matcher_new(void) {
+  struct matcher *m;
+
+  m = malloc(sizeof(struct matcher));
+  if(m == NULL)
+    return NULL;
+  memset(m, 0, sizeof(struct matcher));
+
+  if(new_state(m) < 0) {
+    matcher_free(m);
+    return NULL;
+  }
+  return m;
+}
+
+/****************************************************************************
+ * Add a pattern, returning its id. Adding the same string twice gives
+ * back the same id.
+ ****************************************************************************/
+int matcher_add(struct matcher *m, const char *pattern, int len) {
+  int s = 0, i;
+
+  if(m->built || len == 0)
+    return -1;
+
+  for(i = 0; i < len; i++) {
+    uint8_t c = pattern[i];
+    if(m->next[s][c] < 0) {
+      int n = new_state(m);
+      if(n < 0)
+        return -1;
+      m->next[s][c] = n;
+    }
+    s = m->next[s][c];
+  }
+
+  if(m->output[s] < 0)
+    m->output[s] = m->n_patterns++;
+  return m->output[s];
+}
+
+/****************************************************************************
+ * Work out the fail links breadth first, filling in the missing
+ * transitions from the fail state as we go
+ ****************************************************************************/
+int matcher_build(struct matcher *m) {
+  int *queue;
+  int head = 0, tail = 0, c;
+
+  queue = malloc(m->n_states * sizeof(int));
+  if(queue == NULL)
+    return 0;
+
+  for(c = 0; c < 256; c++) {
+    int n = m->next[0][c];
+    if(n < 0) {
+      m->next[0][c] = 0;
+    } else {
+      m->fail[n] = 0;
+      queue[tail++] = n;
+    }
+  }
+
+  while(head < tail) {
+    int s = queue[head++];
+    int f = m->fail[s];
+
+    m->dict[s] = (m->output[f] >= 0) ? f : m->dict[f];
+
+    for(c = 0; c < 256; c++) {
+      int n = m->next[s][c];
+      if(n < 0) {
+        m->next[s][c] = m->next[f][c];
+      } else {
+        m->fail[n] = m->next[f][c];
+        queue[tail++] = n;
+      }
+    }
+  }
+
+  free(queue);
+  m->built = 1;
+  m->state = 0;
+  return 1;
+}
+
+/****************************************************************************
+ * Move on by one character, calling found() for every pattern that ends
+ * here - longest first
+ ****************************************************************************/
+void matcher_feed(struct matcher *m, uint8_t c, void (*found)(int id, void *arg), void *arg) {
+  int s;
+
+  m->state = s = m->next[m->state][c];
+  if(m->output[s] < 0)
+    s = m->dict[s];
+
+  while(s >= 0) {
+    found(m->output[s], arg);
+    s = m->dict[s];
+  }
+}
+
+/****************************************************************************/
+int matcher_patterns(struct matcher *m) {
+  return m->n_patterns;
+}
+
+/****************************************************************************/
+void matcher_free(struct matcher *m) {
+  if(m == NULL)
+    return;
+  free(m->next);
+  free(m->fail);
+  free(m->output);
+  free(m->dict);
+  free(m);
+}
+/****************************************************************************/
@@ -0,0 +1,10 @@
+#ifndef MATCH_H
+#define MATCH_H
+struct matcher;
+struct matcher *matcher_new(void);
+int  matcher_add(struct matcher *m, const char *pattern, int len);
+int  matcher_build(struct matcher *m);
+void matcher_feed(struct matcher *m, uint8_t c, void (*found)(int id, void *arg), void *arg);
+int  matcher_patterns(struct matcher *m);
+void matcher_free(struct matcher *m);
+#endif
@@ -10,6 +10,7 @@
 #include <stdint.h> 
 #include "memorymap.h"
 #include "memory.h"
+#include "cache.h"
 #include "display.h"
 
 #define FIFO_SIZE (8)
@@ -56,6 +57,9 @@ struct fifo_fetch_request {
   uint32_t address[FIFO_SIZE];
 } fetch_request_fifo;
 
+/* Cycles left before a slow region has finished the last access */
+static uint32_t busy;
+
 /****************************************************************************/
 void memory_reset(void) {
 
@@ -74,13 +78,16 @@ void memory_reset(void) {
   read_request_fifo.count      = 0;
   read_request_fifo.read_ptr   = 0;
   read_request_fifo.write_ptr  = 0;
+  busy = 0;
+  memorymap_take_latency();
+  cache_reset();
   display_log("Memory reset");
 }
 
 /****************************************************************************/
-int memory_initialise(void) {
+int memory_initialise(char *machine_file) {
   memory_reset();
-  return memorymap_initialise();
+  return memorymap_initialise(machine_file);
 }
 
 /****************************************************************************/
@@ -147,6 +154,11 @@ int      memory_write_full(void) {
   return write_request_fifo.count == FIFO_SIZE;
 }
 
+/****************************************************************************/
+int      memory_write_pending(void) {
+  return write_request_fifo.count != 0;
+}
+
 /****************************************************************************/
 int      memory_write_request(uint32_t address, uint32_t mask, uint32_t value) {
   if(write_request_fifo.count == FIFO_SIZE) {
@@ -162,6 +174,11 @@ int      memory_write_request(uint32_t address, uint32_t mask, uint32_t value) {
 
 /****************************************************************************/
 int  memory_run(void) {
+  if(busy > 0) {
+    busy--;
+    return 1;
+  }
+
   if( write_request_fifo.count > 0) {
     uint32_t addr, data;
     uint32_t mask;
@@ -173,7 +190,10 @@ int  memory_run(void) {
     write_request_fifo.read_ptr = (write_request_fifo.read_ptr == FIFO_SIZE-1) ? 0 : write_request_fifo.read_ptr+1;
     write_request_fifo.count--;
 
-    return memorymap_write(addr, mask, data);
+    if(!memorymap_write(addr, mask, data))
+      return 0;
+    busy = cache_access(CACHE_D, addr, 1, memorymap_take_latency());
+    return 1;
   }
 
   /* Process the read request queue */
@@ -187,6 +207,7 @@ int  memory_run(void) {
     if(!memorymap_read(addr, 4, &data)) {
       data = 0;
     }
+    busy = cache_access(CACHE_D, addr, 0, memorymap_take_latency());
     /*Push the data */
     read_data_fifo.data[read_data_fifo.write_ptr] = data;
     read_data_fifo.count++;
@@ -206,6 +227,7 @@ int  memory_run(void) {
     if(!memorymap_read( addr, 4, &data)) {
       data = 0;
     }
+    busy = cache_access(CACHE_I, addr, 0, memorymap_take_latency());
 
     fetch_data_fifo.data[fetch_data_fifo.write_ptr] = data;
     fetch_data_fifo.count++;
@@ -217,5 +239,7 @@ int  memory_run(void) {
 }
 
 void     memory_finish(void) {
+  cache_report();
+  cache_finish();
   memorymap_finish();
 }
@@ -1,6 +1,6 @@
 #ifndef _MEMORY_H
 #define _MEMORY_H
-int      memory_initialise(void);
+int      memory_initialise(char *machine_file);
 
 void     memory_reset(void);
 int      memory_run(void);
@@ -14,6 +14,7 @@ uint32_t memory_read_data_empty(void);
 uint32_t memory_read_data(void);
 
 int      memory_write_full(void);
+int      memory_write_pending(void);
 int      memory_write_request(uint32_t address, uint32_t mask, uint32_t value);
 
 void     memory_finish(void);
@@ -10,27 +10,103 @@
 #include <malloc.h>
 #include <stdint.h>
 #include <memory.h>
+#include <stdio.h>
 #include "region.h"
+#include "config.h"
+#include "memorymap.h"
 #include "ram.h"
+#include "nvram.h"
 #include "rom.h"
 #include "prci.h"
 #include "gpio.h"
 #include "uart.h"
 #include "spi.h"
 #include "clint.h"
+#include "plic.h"
+#include "flash.h"
+#include "cache.h"
+#include "bpred.h"
+#include "timing.h"
 #include "display.h"
 
+#define DIRTY_WORDS(size) ((((size) + MEMORYMAP_PAGE_SIZE - 1) >> MEMORYMAP_PAGE_SHIFT) + 31) / 32
+
 struct region *first_region = NULL;
+static uint32_t access_latency;
+static uint64_t mmio_accesses;
+static uint64_t impure_reads;
+
+/* The types of region that can appear in a machine description */
+/****************************************************************************
+ * For regions where no register changes when it is read
+ ****************************************************************************/
+static int all_pure(struct region *r, uint32_t address) {
+  return 1;
+}
+
+struct region_type {
+  char *name;
+  int  (*init)(struct region *r);
+  int  (*get)(struct region *r, uint32_t address, uint32_t *value);
+  int  (*set)(struct region *r, uint32_t address, uint8_t mask, uint32_t value);
+  void (*free)(struct region *r);
+  void (*dump)(struct region *r);
+  int  (*load)(struct region *r, uint32_t address, const uint8_t *src, uint32_t len);
+  int  (*pure)(struct region *r, uint32_t address);
+  int  track_dirty;
+  int  executable;
+} region_types[] = {
+  {"rom",   ROM_init,   ROM_get,   ROM_set,   ROM_free,   ROM_dump,   ROM_load,   all_pure,  0, 1},
+  {"ram",   RAM_init,   RAM_get,   RAM_set,   RAM_free,   RAM_dump,   RAM_load,   all_pure,  1, 1},
+  {"nvram", NVRAM_init, RAM_get,   RAM_set,   NVRAM_free, RAM_dump,   RAM_load,   all_pure,  1, 1},
+  {"prci",  PRCI_init,  PRCI_get,  PRCI_set,  PRCI_free,  PRCI_dump,  NULL,       all_pure,  0, 0},
+  {"gpio",  GPIO_init,  GPIO_get,  GPIO_set,  GPIO_free,  GPIO_dump,  NULL,       all_pure,  0, 0},
+  {"uart",  UART_init,  UART_get,  UART_set,  UART_free,  UART_dump,  NULL,       UART_pure, 0, 0},
+  {"spi",   SPI_init,   SPI_get,   SPI_set,   SPI_free,   SPI_dump,   NULL,       SPI_pure,  0, 0},
+  {"clint", CLINT_init, CLINT_get, CLINT_set, CLINT_free, CLINT_dump, NULL,       all_pure,  0, 0},
+  {"plic",  PLIC_init,  PLIC_get,  PLIC_set,  PLIC_free,  PLIC_dump,  NULL,       PLIC_pure, 0, 0},
+  {"flash", FLASH_init, FLASH_get, FLASH_set, FLASH_free, FLASH_dump, FLASH_load, all_pure,  0, 1}
+};
+
+/* Used when no machine description file is given - a HiFive1 */
+static char *default_machine[] = {
+  "rom   0x20400000 118476",
+  "ram   0x80000000 0x4000",
+  "ram   0x10000000 0x0170  name=aon",
+  "prci  0x10008000 0x0FFF",
+  "gpio  0x10012000 0x0FFF  irq=8",
+  "uart  0x10013000 0x0FFF  irq=3",
+  "spi   0x10014000 0x0080",
+  "clint 0x02000000 0x10000",
+  "plic  0x0C000000 0x4000000",
+  NULL
+};
 
 /****************************************************************************/
-static int add_region(uint32_t base, uint32_t size, 
-  int  (*init)(struct region *r),
-  int (*get)(struct region *r, uint32_t address, uint32_t *value),
-  int (*set)(struct region *r, uint32_t address, uint8_t mask, uint32_t value),
-  void (*free)(struct region *r),
-  void (*dump)(struct region *r)) {
+static int add_region(uint32_t base, uint32_t size, struct region_type *type,
+  char *name, char *options) {
   struct region *r = NULL;
 
+  if((uint64_t)base + size > 0x100000000ULL) {
+    char buffer[128];
+    sprintf(buffer, "Region at 0x%08x runs past the end of memory", base);
+    display_log(buffer);
+    return 0;
+  }
+
+  /* Check it doesn't overlap with anything already in the map, working
+   * in 64 bits so a region right at the top of memory doesn't wrap */
+  r = first_region;
+  while(r != NULL) {
+    if(base < (uint64_t)r->base + r->size && r->base < (uint64_t)base + size) {
+      char buffer[128];
+      sprintf(buffer, "Region at 0x%08x overlaps region at 0x%08x", base, r->base);
+      display_log(buffer);
+      return 0;
+    }
+    r = r->next;
+  }
+
   /* Allocate space */
   r = malloc(sizeof(struct region));
   if(r == NULL) {
@@ -39,13 +115,34 @@ static int add_region(uint32_t base, uint32_t size,
 
   /* Initialise it */
   memset(r,0,sizeof(struct region));
-  r->base = base;
-  r->size = size;
-  r->init = init;
-  r->get  = get;
-  r->set  = set;
-  r->free = free;
-  r->dump = dump;
+  r->base    = base;
+  r->size    = size;
+  r->init    = type->init;
+  r->get     = type->get;
+  r->set     = type->set;
+  r->free    = type->free;
+  r->dump    = type->dump;
+  r->load    = type->load;
+  r->pure    = type->pure;
+  r->name    = strdup(name);
+  r->options = strdup(options);
+  r->executable = type->executable;
+  /* Any region can be slower than the core */
+  config_option_number(options, "latency", &r->latency);
+  /* Memory is cached (if there are caches) unless it says otherwise */
+  if(r->executable) {
+    char value[8];
+    r->cacheable = !config_option(options, "cacheable", value, sizeof(value)) || strcmp(value, "no") != 0;
+  }
+  if(type->track_dirty)
+    r->dirty = calloc(DIRTY_WORDS(size), sizeof(uint32_t));
+  if(r->name == NULL || r->options == NULL || (type->track_dirty && r->dirty == NULL)) {
+    free(r->name);
+    free(r->options);
+    free(r->dirty);
+    free(r);
+    return 0;
+  }
 
   /* Add to list */
   if(first_region == NULL) {
@@ -61,16 +158,197 @@ static int add_region(uint32_t base, uint32_t size,
   return 1;
 }
 
+/****************************************************************************
+ * Glue key=value pairs back together into one option string
+ ****************************************************************************/
+static int glue_options(char *argv[], int first, int argc, char *options, int size) {
+  int used = 0, j;
+
+  options[0] = '\0';
+  for(j = first; j < argc; j++) {
+    int n = snprintf(options+used, size-used, "%s ", argv[j]);
+    if(n >= size-used)
+      return 0;
+    used += n;
+  }
+  return 1;
+}
+
+/****************************************************************************
+ * Each line of a machine description is
+ *
+ *    type  base  size  [option=value ...]
+ *
+ * e.g. "ram 0x80000000 64K name=dtim image=data.img"
+ ****************************************************************************/
+static int parse_machine_line(char *line, int line_no) {
+  char *argv[CONFIG_MAX_ARGS];
+  char options[512];
+  char name[32];
+  char buffer[128];
+  uint32_t base, size;
+  int argc, i;
+
+  argc = config_split(line, argv, CONFIG_MAX_ARGS);
+  if(argc == 0)
+    return 1;
+
+  /* Caches are "icache size [option=value ...]" */
+  if(argc >= 2 && (strcmp(argv[0], "icache") == 0 || strcmp(argv[0], "dcache") == 0)) {
+    if(!glue_options(argv, 2, argc, options, sizeof(options))
+       || !cache_configure(argv[0][0] == 'i' ? CACHE_I : CACHE_D, argv[1], options)) {
+      sprintf(buffer, "Machine line %i: bad cache description", line_no);
+      display_log(buffer);
+      return 0;
+    }
+    return 1;
+  }
+
+  /* The pipeline's latencies are "pipeline [option=value ...]" */
+  if(strcmp(argv[0], "pipeline") == 0) {
+    if(!glue_options(argv, 1, argc, options, sizeof(options)) || !timing_configure(options)) {
+      sprintf(buffer, "Machine line %i: bad pipeline description", line_no);
+      display_log(buffer);
+      return 0;
+    }
+    return 1;
+  }
+
+  /* And the branch predictor "bpred model [option=value ...]" */
+  if(argc >= 2 && strcmp(argv[0], "bpred") == 0) {
+    if(!glue_options(argv, 2, argc, options, sizeof(options))
+       || !bpred_configure(argv[1], options)) {
+      sprintf(buffer, "Machine line %i: bad branch predictor description", line_no);
+      display_log(buffer);
+      return 0;
+    }
+    return 1;
+  }
+
+  if(argc < 3) {
+    sprintf(buffer, "Machine line %i: expected 'type base size'", line_no);
+    display_log(buffer);
+    return 0;
+  }
+
+  for(i = 0; i < sizeof(region_types)/sizeof(struct region_type); i++) {
+    if(strcmp(argv[0], region_types[i].name) == 0)
+      break;
+  }
+  if(i == sizeof(region_types)/sizeof(struct region_type)) {
+    sprintf(buffer, "Machine line %i: unknown region type '%.32s'", line_no, argv[0]);
+    display_log(buffer);
+    return 0;
+  }
+
+  if(!config_number(argv[1], &base) || !config_number(argv[2], &size) || size == 0) {
+    sprintf(buffer, "Machine line %i: bad base or size", line_no);
+    display_log(buffer);
+    return 0;
+  }
+
+  /* Glue the remaining key=value pairs back together */
+  if(!glue_options(argv, 3, argc, options, sizeof(options))) {
+    sprintf(buffer, "Machine line %i: options too long", line_no);
+    display_log(buffer);
+    return 0;
+  }
+
+  if(!config_option(options, "name", name, sizeof(name)))
+    strcpy(name, region_types[i].name);
+
+  if(!add_region(base, size, region_types+i, name, options)) {
+    sprintf(buffer, "Machine line %i: unable to add region", line_no);
+    display_log(buffer);
+    return 0;
+  }
+  return 1;
+}
+
 /****************************************************************************/
-int memorymap_aligned_read(uint32_t address, uint32_t *value) {
-   struct region *r = first_region;
+static int load_machine(char *fname) {
+  char line[1024];
+  int line_no = 0;
+  FILE *f;
 
-   /* Find the region */
-   while(r != NULL) {
-     if(address >= r->base && address < r->base+r->size)
-       break;
-     r = r->next;
-   }
+  /* No file given, so use the built-in machine */
+  if(fname == NULL) {
+    int i;
+    for(i = 0; default_machine[i] != NULL; i++) {
+      strcpy(line, default_machine[i]);
+      if(!parse_machine_line(line, i+1))
+        return 0;
+    }
+    return 1;
+  }
+
+  f = fopen(fname, "r");
+  if(f == NULL) {
+    char buffer[128];
+    sprintf(buffer, "Unable to open machine file '%.64s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  while(fgets(line, sizeof(line), f) != NULL) {
+    line_no++;
+    if(!parse_machine_line(line, line_no)) {
+      fclose(f);
+      return 0;
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+/****************************************************************************
+ * Extra cycles owed by the accesses made since the last call, for regions
+ * slower than the core (e.g. flash with latency=)
+ ****************************************************************************/
+uint32_t memorymap_take_latency(void) {
+  uint32_t l = access_latency;
+  access_latency = 0;
+  return l;
+}
+
+/****************************************************************************
+ * Reads and writes of peripheral registers so far, for the perf counters
+ ****************************************************************************/
+uint64_t memorymap_mmio_accesses(void) {
+  return mmio_accesses;
+}
+
+/****************************************************************************
+ * Reads that may have changed something (popped a FIFO, claimed an
+ * interrupt...), so a loop doing them can't be skipped
+ ****************************************************************************/
+uint64_t memorymap_impure_reads(void) {
+  return impure_reads;
+}
+
+/****************************************************************************
+ * Accesses made by polling loop iterations the CPU skipped
+ ****************************************************************************/
+void memorymap_skip_mmio_accesses(uint64_t n) {
+  mmio_accesses += n;
+}
+
+/****************************************************************************
+ * The region holding address, or NULL
+ ****************************************************************************/
+struct region *memorymap_find(uint32_t address) {
+  struct region *r;
+
+  for(r = first_region; r != NULL; r = r->next) {
+    if(address - r->base < r->size)
+      return r;
+  }
+  return NULL;
+}
+
+/****************************************************************************/
+int memorymap_aligned_read(uint32_t address, uint32_t *value) {
+   struct region *r = memorymap_find(address);
 
    /* If no region found then exit */
    if(r == NULL) {
@@ -81,23 +359,21 @@ int memorymap_aligned_read(uint32_t address, uint32_t *value) {
    }
 
    /* Trap a currently unhandled error */
-   if(address+4 > r->base + r->size) {
+   if(r->size < 4 || address - r->base > r->size - 4) {
      display_log("Need to split the read of address as it crosses boundary");
      return 0;
    }
+   access_latency += r->latency;
+   if(!r->executable)
+     mmio_accesses++;
+   if(r->pure == NULL || !r->pure(r, address-r->base))
+     impure_reads++;
    return r->get(r, address-r->base, value);
 }
 
 /****************************************************************************/
 int memorymap_aligned_write(uint32_t address, uint8_t mask, uint32_t value) {
-   struct region *r = first_region;
-
-   /* Find the region */
-   while(r != NULL) {
-     if(address >= r->base && address < r->base+r->size)
-       break;
-     r = r->next;
-   }
+   struct region *r = memorymap_find(address);
 
    /* If no region found then exit */
    if(r == NULL) {
@@ -108,58 +384,117 @@ int memorymap_aligned_write(uint32_t address, uint8_t mask, uint32_t value) {
    }
 
    /* Trap a currently unhandled error */
-   if(address+4 > r->base + r->size) {
+   if(r->size < 4 || address - r->base > r->size - 4) {
      display_log("Write to split the read of address as it crosses boundary");
      return 0;
    }
+
+   /* Note which page has been written to */
+   if(r->dirty != NULL) {
+     uint32_t page = (address-r->base) >> MEMORYMAP_PAGE_SHIFT;
+     r->dirty[page>>5] |= 1u << (page & 31);
+   }
+   access_latency += r->latency;
+   if(!r->executable)
+     mmio_accesses++;
    return r->set(r, address-r->base, mask, value);
 }
 
-/****************************************************************************/
-int memorymap_initialise(char *image) {
+/****************************************************************************
+ * Call fn() for each dirty page in all the regions that track writes
+ ****************************************************************************/
+void memorymap_dirty_pages(void (*fn)(struct region *r, uint32_t address, void *arg), void *arg) {
   struct region *r;
-  if(!add_region(0x20400000, 118476, ROM_init, ROM_get, ROM_set, ROM_free, ROM_dump)) {
-    display_log("Unable to add regions");
-    return 0;
-  }
 
-  if(!add_region(0x80000000, 0x4000, RAM_init, RAM_get, RAM_set, RAM_free, RAM_dump)) {
-    display_log("Unable to add regions");
-    return 0;
-  }
- 
-  // AON
-  if(!add_region(0x10000000, 0x0170, RAM_init, RAM_get, RAM_set, RAM_free, RAM_dump)) {
-    display_log("Unable to add regions");
-    return 0;
+  for(r = first_region; r != NULL; r = r->next) {
+    uint32_t w;
+    if(r->dirty == NULL)
+      continue;
+
+    for(w = 0; w < DIRTY_WORDS(r->size); w++) {
+      uint32_t bits = r->dirty[w];
+      while(bits != 0) {
+        int b = __builtin_ctz(bits);
+        fn(r, r->base + (((w<<5)+b) << MEMORYMAP_PAGE_SHIFT), arg);
+        bits &= bits-1;
+      }
+    }
   }
+}
 
-  // PRCI
-  if(!add_region(0x10008000, 0x0FFF, PRCI_init, PRCI_get, PRCI_set, PRCI_free, PRCI_dump)) {
-    display_log("Unable to add regions");
-    return 0;
+/****************************************************************************
+ * Call fn() for each region that code can be run from
+ ****************************************************************************/
+void memorymap_code_regions(void (*fn)(struct region *r, void *arg), void *arg) {
+  struct region *r;
+
+  for(r = first_region; r != NULL; r = r->next) {
+    if(r->executable)
+      fn(r, arg);
   }
+}
 
-  // GPIO 
-  if(!add_region(0x10012000, 0x0FFF, GPIO_init, GPIO_get, GPIO_set, GPIO_free, GPIO_dump)) {
-    display_log("Unable to add regions");
-    return 0;
+/****************************************************************************/
+int memorymap_page_dirty(uint32_t address) {
+  struct region *r;
+
+  for(r = first_region; r != NULL; r = r->next) {
+    if(address >= r->base && address - r->base < r->size) {
+      uint32_t page = (address-r->base) >> MEMORYMAP_PAGE_SHIFT;
+      return r->dirty != NULL && (r->dirty[page>>5] & (1u << (page & 31)));
+    }
   }
-  
-  // UART 
-  if(!add_region(0x10013000, 0x0FFF, UART_init, UART_get, UART_set, UART_free, UART_dump)) {
-    display_log("Unable to add regions");
-    return 0;
+  return 0;
+}
+
+/****************************************************************************/
+void memorymap_dirty_clear(void) {
+  struct region *r;
+
+  for(r = first_region; r != NULL; r = r->next) {
+    if(r->dirty != NULL)
+      memset(r->dirty, 0, DIRTY_WORDS(r->size)*sizeof(uint32_t));
   }
-  
-  // SPI  
-  if(!add_region(0x10014000, 0x0080, SPI_init, SPI_get, SPI_set, SPI_free, SPI_dump)) {
-    display_log("Unable to add regions");
-    return 0;
+}
+
+/****************************************************************************
+ * Report how many pages of each region have been written to, and if a
+ * file is given, which ones.
+ ****************************************************************************/
+void memorymap_dirty_report(FILE *f) {
+  struct region *r;
+
+  for(r = first_region; r != NULL; r = r->next) {
+    uint32_t w, pages, touched = 0;
+    char buffer[128];
+
+    if(r->dirty == NULL)
+      continue;
+
+    pages = (r->size + MEMORYMAP_PAGE_SIZE - 1) >> MEMORYMAP_PAGE_SHIFT;
+    for(w = 0; w < DIRTY_WORDS(r->size); w++)
+      touched += __builtin_popcount(r->dirty[w]);
+
+    sprintf(buffer, "%.16s 0x%08x: %u of %u pages touched (%u bytes)",
+            r->name, r->base, touched, pages, touched * MEMORYMAP_PAGE_SIZE);
+    display_log(buffer);
+
+    if(f != NULL) {
+      uint32_t p;
+      fprintf(f, "%s\n", buffer);
+      for(p = 0; p < pages; p++) {
+        if(r->dirty[p>>5] & (1u << (p & 31)))
+          fprintf(f, "  0x%08x\n", r->base + (p << MEMORYMAP_PAGE_SHIFT));
+      }
+    }
   }
-  
+}
 
-  if(!add_region(0x02000000, 0x10000, CLINT_init, CLINT_get, CLINT_set, CLINT_free, CLINT_dump)) {
+/****************************************************************************/
+int memorymap_initialise(char *machine_file) {
+  struct region *r;
+
+  if(!load_machine(machine_file)) {
     display_log("Unable to add regions");
     return 0;
   }
@@ -176,6 +511,42 @@ int memorymap_initialise(char *image) {
   return 1;
 }
 
+/****************************************************************************
+ * Bulk copy an image into memory, which may span several regions. A NULL
+ * source fills with zeros.
+ ****************************************************************************/
+int memorymap_load(uint32_t address, const uint8_t *src, uint32_t len) {
+  while(len > 0) {
+    struct region *r = first_region;
+    uint32_t chunk;
+
+    while(r != NULL) {
+      if(address >= r->base && address - r->base < r->size)
+        break;
+      r = r->next;
+    }
+
+    if(r == NULL || r->load == NULL) {
+      char buffer[128];
+      sprintf(buffer, "Unable to load image data at %08X", address);
+      display_log(buffer);
+      return 0;
+    }
+
+    chunk = r->size - (address - r->base);
+    if(chunk > len)
+      chunk = len;
+    if(!r->load(r, address - r->base, src, chunk))
+      return 0;
+
+    address += chunk;
+    len     -= chunk;
+    if(src != NULL)
+      src += chunk;
+  }
+  return 1;
+}
+
 /****************************************************************************/
 int memorymap_read(uint32_t address, uint8_t width, uint32_t *value) {
    uint32_t v, v1, mask;
@@ -335,6 +706,9 @@ void memorymap_finish(void) {
       struct region *r = first_region;
       first_region = first_region->next;
       r->free(r);
+      free(r->name);
+      free(r->options);
+      free(r->dirty);
       free(r);
    }
 }
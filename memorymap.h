@@ -1,10 +1,28 @@
 #ifndef MEMORYMAP_H
 #define MEMORYMAP_H
-int memorymap_initialise(void);
-uint32_t memorymap_read(uint32_t address, uint8_t width, uint32_t *value);
+#include <stdio.h>
+struct region;
+
+/* Granularity of dirty page tracking */
+#define MEMORYMAP_PAGE_SHIFT (10)
+#define MEMORYMAP_PAGE_SIZE  (1 << MEMORYMAP_PAGE_SHIFT)
+
+int memorymap_initialise(char *machine_file);
+int  memorymap_read(uint32_t address, uint8_t width, uint32_t *value);
 int  memorymap_write(uint32_t address, uint32_t width, uint32_t value);
 int  memorymap_aligned_read(uint32_t address, uint32_t *value);
-int  memorymap_aligned_write(uint32_t address, uint32_t mask, uint32_t value);
+int  memorymap_aligned_write(uint32_t address, uint8_t mask, uint32_t value);
+int  memorymap_load(uint32_t address, const uint8_t *src, uint32_t len);
+uint32_t memorymap_take_latency(void);
+uint64_t memorymap_mmio_accesses(void);
+uint64_t memorymap_impure_reads(void);
+void memorymap_skip_mmio_accesses(uint64_t n);
+struct region *memorymap_find(uint32_t address);
+void memorymap_dirty_pages(void (*fn)(struct region *r, uint32_t address, void *arg), void *arg);
+void memorymap_code_regions(void (*fn)(struct region *r, void *arg), void *arg);
+int  memorymap_page_dirty(uint32_t address);
+void memorymap_dirty_clear(void);
+void memorymap_dirty_report(FILE *f);
 void memorymap_dump(void);
 void memorymap_dump(void);
 void memorymap_finish(void);
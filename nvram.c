@@ -0,0 +1,82 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "region.h"
+#include "config.h"
+#include "nvram.h"
+#include "display.h"
+
+/****************************************************************************
+ * Memory backed by a shared mapping of a host file, so the contents
+ * survive between runs and other programs can see (and change) them
+ * while the emulator is running. Reads and writes are the same as RAM.
+ ****************************************************************************/
+int NVRAM_init(struct region *r) {
+  char fname[256];
+  char buffer[300];
+  struct stat st;
+  void *map;
+  int fd;
+
+  if(r->data != NULL) {
+    display_log("NVRAM already initialized");
+    return 0;
+  }
+
+  if(!config_option(r->options, "file", fname, sizeof(fname)))
+    sprintf(fname, "nvram_%08x.bin", r->base);
+
+  fd = open(fname, O_RDWR | O_CREAT, 0644);
+  if(fd < 0) {
+    sprintf(buffer, "Unable to open NVRAM file '%.64s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  /* New (or short) files are extended with zeros */
+  if(fstat(fd, &st) != 0 || (st.st_size < r->size && ftruncate(fd, r->size) != 0)) {
+    sprintf(buffer, "Unable to size NVRAM file '%.64s'", fname);
+    display_log(buffer);
+    close(fd);
+    return 0;
+  }
+
+  map = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    sprintf(buffer, "Unable to map NVRAM file '%.64s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  r->data = map;
+  sprintf(buffer, "Set up NVRAM region from '%.64s'", fname);
+  display_log(buffer);
+  return 1;
+}
+
+/****************************************************************************/
+void NVRAM_free(struct region *r) {
+   char buffer[100];
+   sprintf(buffer, "Releasing NVRAM at 0x%08x", r->base);
+   display_log(buffer);
+   if(r->data != NULL) {
+     msync(r->data, r->size, MS_SYNC);
+     munmap(r->data, r->size);
+   }
+}
+/****************************************************************************/
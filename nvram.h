@@ -0,0 +1,2 @@
+int  NVRAM_init(struct region *r);
+void NVRAM_free(struct region *r);
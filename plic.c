@@ -0,0 +1,294 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdint.h>
+#include <memory.h>
+#include "region.h"
+#include "config.h"
+#include "plic.h"
+#include "riscv.h"
+#include "display.h"
+#include "log.h"
+
+/****************************************************************************
+ * Platform-Level Interrupt Controller, with the one machine mode context
+ * the FE310 has.
+ *
+ * Sources are level triggered. A source going high becomes pending, a
+ * claim clears the pending bit and blocks the source until its complete
+ * is written, when it goes pending again if it is still high.
+ *
+ * For each priority there is a bitmap of the sources that are pending,
+ * enabled and at that priority, plus a summary word saying which words
+ * of that bitmap are non-zero. Finding the source to claim is then a
+ * couple of find-first-set operations per priority level.
+ ****************************************************************************/
+#define PLIC_MAX_SOURCES   1024
+#define PLIC_WORDS         (PLIC_MAX_SOURCES/32)
+#define PLIC_PRIORITIES    8
+#define PLIC_DEFAULT_SOURCES 52
+
+#define PLIC_PRIORITY_BASE 0x000000
+#define PLIC_PENDING_BASE  0x001000
+#define PLIC_ENABLE_BASE   0x002000
+#define PLIC_THRESHOLD     0x200000
+#define PLIC_CLAIM         0x200004
+
+struct plic_data {
+  uint32_t sources;
+  uint32_t words;
+  uint32_t threshold;
+  uint8_t  priority[PLIC_MAX_SOURCES];
+  uint32_t level[PLIC_WORDS];
+  uint32_t pending[PLIC_WORDS];
+  uint32_t enable[PLIC_WORDS];
+  uint32_t claimed[PLIC_WORDS];
+  uint32_t active[PLIC_PRIORITIES][PLIC_WORDS];
+  uint32_t summary[PLIC_PRIORITIES];
+};
+
+/* There is only ever one PLIC, devices signal it directly */
+static struct plic_data *plic;
+
+/****************************************************************************
+ * Recalculate the active bits for one word of sources
+ ****************************************************************************/
+static void update_word(struct plic_data *data, int w) {
+  uint32_t ready = data->pending[w] & data->enable[w];
+  int p;
+
+  for(p = 1; p < PLIC_PRIORITIES; p++)
+    data->active[p][w] = 0;
+
+  /* Priority 0 means never interrupt, so those are left out */
+  while(ready) {
+    int b = __builtin_ctz(ready);
+    p = data->priority[w*32+b];
+    data->active[p][w] |= 1u << b;
+    ready &= ready-1;
+  }
+
+  for(p = 1; p < PLIC_PRIORITIES; p++) {
+    if(data->active[p][w])
+      data->summary[p] |=  (1u << w);
+    else
+      data->summary[p] &= ~(1u << w);
+  }
+}
+
+/****************************************************************************
+ * The highest priority source that is above the threshold, or 0
+ ****************************************************************************/
+static uint32_t best_source(struct plic_data *data) {
+  int p;
+
+  for(p = PLIC_PRIORITIES-1; p > (int)data->threshold; p--) {
+    if(data->summary[p]) {
+      int w = __builtin_ctz(data->summary[p]);
+      return w*32 + __builtin_ctz(data->active[p][w]);
+    }
+  }
+  return 0;
+}
+
+/****************************************************************************/
+static void update_meip(struct plic_data *data) {
+  riscv_set_irq(IRQ_M_EXT, best_source(data) != 0);
+}
+
+/****************************************************************************
+ * Called by devices whenever their interrupt line changes
+ ****************************************************************************/
+void plic_set_source(uint32_t source, int level) {
+  struct plic_data *data = plic;
+  uint32_t w = source / 32, bit = 1u << (source % 32);
+
+  if(data == NULL || source == 0 || source >= data->sources)
+    return;
+
+  if(level) {
+    data->level[w] |= bit;
+    if(!(data->claimed[w] & bit) && !(data->pending[w] & bit)) {
+      data->pending[w] |= bit;
+      update_word(data, w);
+      update_meip(data);
+    }
+  } else {
+    data->level[w] &= ~bit;
+  }
+}
+
+/****************************************************************************/
+int PLIC_init(struct region *r) {
+  struct plic_data *data;
+  uint32_t sources = PLIC_DEFAULT_SOURCES;
+
+  if(r->data != NULL) {
+    display_log("PLIC already initialized");
+    return 0;
+  }
+  if(plic != NULL) {
+    display_log("Only one PLIC is supported");
+    return 0;
+  }
+
+  config_option_number(r->options, "sources", &sources);
+  if(sources < 1 || sources > PLIC_MAX_SOURCES) {
+    display_log("PLIC sources must be between 1 and 1024");
+    return 0;
+  }
+
+  data = malloc(sizeof(struct plic_data));
+  if(data == NULL){
+    return 0;
+  }
+  memset(data, 0, sizeof(struct plic_data));
+  data->sources = sources;
+  data->words   = (sources+31)/32;
+
+  r->data = (void *)data;
+  plic = data;
+  display_log("Set up PLIC region");
+  return 1;
+}
+
+/****************************************************************************/
+static uint32_t claim(struct plic_data *data) {
+  uint32_t id = best_source(data);
+
+  if(id != 0) {
+    uint32_t w = id / 32, bit = 1u << (id % 32);
+    data->pending[w] &= ~bit;
+    data->claimed[w] |=  bit;
+    update_word(data, w);
+    update_meip(data);
+  }
+  return id;
+}
+
+/****************************************************************************/
+static void complete(struct plic_data *data, uint32_t id) {
+  uint32_t w = id / 32, bit = 1u << (id % 32);
+
+  if(id == 0 || id >= data->sources || !(data->claimed[w] & bit))
+    return;
+
+  data->claimed[w] &= ~bit;
+  if(data->level[w] & bit) {
+    data->pending[w] |= bit;
+    update_word(data, w);
+    update_meip(data);
+  }
+}
+
+/****************************************************************************/
+int PLIC_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
+   struct plic_data *data = r->data;
+   if(address+4 > r->size) {
+     fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
+     return 0;
+   }
+
+   if((address & 3) != 0) {
+     fprintf(stderr,"Unaligned memory write 0x%08x\n", r->base+address);
+   }
+   log_msg(LOG_PLIC, LOG_DEBUG, "PLIC Wr address 0x%08x: 0x%08x", address, value);
+
+   if(address < PLIC_PENDING_BASE) {
+     uint32_t id = address/4;
+     if(id > 0 && id < data->sources) {
+       data->priority[id] = value & (PLIC_PRIORITIES-1);
+       update_word(data, id/32);
+       update_meip(data);
+     }
+   } else if(address >= PLIC_ENABLE_BASE && address < PLIC_ENABLE_BASE + data->words*4) {
+     uint32_t w = (address - PLIC_ENABLE_BASE)/4;
+     data->enable[w] = value;
+     if(w == 0)
+       data->enable[0] &= ~1u;
+     if(w == data->words-1 && data->sources % 32)
+       data->enable[w] &= (1u << (data->sources % 32)) - 1;
+     update_word(data, w);
+     update_meip(data);
+   } else if(address == PLIC_THRESHOLD) {
+     data->threshold = value & (PLIC_PRIORITIES-1);
+     update_meip(data);
+   } else if(address == PLIC_CLAIM) {
+     complete(data, value);
+   }
+   /* Pending bits are read only, everything else is reserved */
+   return 1;
+}
+
+/****************************************************************************
+ * Reading the claim register claims an interrupt, nothing else changes
+ ****************************************************************************/
+int PLIC_pure(struct region *r, uint32_t address) {
+   return address != PLIC_CLAIM;
+}
+
+/****************************************************************************/
+int PLIC_get(struct region *r, uint32_t address, uint32_t *value) {
+   struct plic_data *data = r->data;
+   if((address & 3) != 0) {
+     fprintf(stderr,"Unaligned memory read 0x%08x\n", r->base+address);
+     return 0;
+   }
+
+   if(address+4 > r->size) {
+     fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
+     return 0;
+   }
+
+   *value = 0;
+   if(address < PLIC_PENDING_BASE) {
+     uint32_t id = address/4;
+     if(id < data->sources)
+       *value = data->priority[id];
+   } else if(address >= PLIC_PENDING_BASE && address < PLIC_PENDING_BASE + data->words*4) {
+     *value = data->pending[(address - PLIC_PENDING_BASE)/4];
+   } else if(address >= PLIC_ENABLE_BASE && address < PLIC_ENABLE_BASE + data->words*4) {
+     *value = data->enable[(address - PLIC_ENABLE_BASE)/4];
+   } else if(address == PLIC_THRESHOLD) {
+     *value = data->threshold;
+   } else if(address == PLIC_CLAIM) {
+     *value = claim(data);
+   }
+
+   log_msg(LOG_PLIC, LOG_DEBUG, "PLIC Rd address 0x%08x: 0x%08x", address, *value);
+   return 1;
+}
+
+/****************************************************************************/
+void PLIC_dump(struct region *r) {
+   struct plic_data *data = r->data;
+   uint32_t i;
+
+   printf("PLIC 0x%08x length 0x%08x\n", r->base, r->size);
+   printf("threshold %u\n", data->threshold);
+   for(i = 0; i < data->words; i++) {
+     printf("%4u: pending %08x enable %08x claimed %08x level %08x\n", i*32,
+            data->pending[i], data->enable[i], data->claimed[i], data->level[i]);
+   }
+}
+
+/****************************************************************************/
+void PLIC_free(struct region *r) {
+   char buffer[100];
+   sprintf(buffer, "Releasing PLIC at 0x%08x", r->base);
+   display_log(buffer);
+   if(r->data != NULL) {
+     if(plic == r->data)
+       plic = NULL;
+     free(r->data);
+   }
+}
+/****************************************************************************/
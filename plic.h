@@ -0,0 +1,10 @@
+#ifndef PLIC_H
+#define PLIC_H
+int  PLIC_init(struct region *r);
+int  PLIC_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value);
+int  PLIC_get(struct region *r, uint32_t address, uint32_t *value);
+int  PLIC_pure(struct region *r, uint32_t address);
+void PLIC_dump(struct region *r);
+void PLIC_free(struct region *r);
+void plic_set_source(uint32_t source, int level);
+#endif
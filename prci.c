@@ -14,6 +14,7 @@
 #include "region.h"
 #include "ram.h"
 #include "display.h"
+#include "log.h"
 
 /****************************************************************************/
 int PRCI_init(struct region *r) {
@@ -36,7 +37,6 @@ int PRCI_init(struct region *r) {
 
 /****************************************************************************/
 int PRCI_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
-   char buffer[100];
    if(address+4 > r->size) {
      fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
      return 0;
@@ -45,8 +45,7 @@ int PRCI_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory write 0x%08x\n", r->base+address);
    }
-   sprintf(buffer,"PRCI Wr address 0x%08x: 0x%08x", address, value);
-   display_log(buffer);
+   log_msg(LOG_PRCI, LOG_DEBUG, "PRCI Wr address 0x%08x: 0x%08x", address, value);
 
    if(mask & 1) {
       ((unsigned char *)r->data)[address+0] = value; 
@@ -66,7 +65,6 @@ int PRCI_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
 /****************************************************************************/
 int PRCI_get(struct region *r, uint32_t address, uint32_t *value) {
    uint32_t v = 0;
-   char buffer[100];
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory read 0x%08x\n", r->base+address);
      return 0;
@@ -92,8 +90,7 @@ int PRCI_get(struct region *r, uint32_t address, uint32_t *value) {
    }
    *value = v;
      
-   sprintf(buffer,"PRCI Rd address 0x%08x: 0x%08x", address, v);
-   display_log(buffer);
+   log_msg(LOG_PRCI, LOG_DEBUG, "PRCI Rd address 0x%08x: 0x%08x", address, v);
 
    return 1;
 }
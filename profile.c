@@ -0,0 +1,277 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "profile.h"
+#include "riscv.h"
+#include "symbols.h"
+#include "display.h"
+
+/****************************************************************************
+ * Call graph profiler.
+ *
+ * A shadow call stack is kept from the jumps the guest makes, using the
+ * same hints as a return address stack predictor - a JAL or JALR that
+ * writes ra (or t0) is a call, a JALR through ra (or t0) that doesn't is
+ * a return. Traps push a frame for the handler, which MRET pops.
+ *
+ * Each frame points at a node in a tree of every call path seen. Cycles
+ * are only counted up when the stack changes - the time since the last
+ * change goes to the node on top - so the cost is a little work per call
+ * and return, and nothing per instruction.
+ *
+ * At the end the tree is written out as folded stacks, one line per path
+ * with the cycles spent in it, ready for flamegraph.pl and friends.
+ * Frames are named from the ELF symbols where there are any. Stall
+ * cycles show as an extra "[stalled]" frame on top of the path.
+ ****************************************************************************/
+#define PROFILE_MAX_DEPTH 1024
+#define PROFILE_ROOT      0
+#define PROFILE_MAX_NAME  64
+
+#define REG_RA 1
+#define REG_T0 5
+
+struct node {
+  uint32_t func;
+  uint32_t parent;
+  uint32_t child;
+  uint32_t sibling;
+  uint64_t cycles;
+  uint64_t stalls;
+};
+
+struct frame {
+  uint32_t node;
+  uint32_t ret;
+  uint8_t  trap;
+};
+
+int profile_active = 0;
+
+static struct node *nodes;
+static uint32_t n_nodes;
+static uint32_t max_nodes;
+
+static struct frame stack[PROFILE_MAX_DEPTH];
+static int depth;
+static uint32_t overflows;
+
+static uint64_t last_cycles;
+static uint32_t last_stalls;
+
+/****************************************************************************
+ * Give the cycles since the last change to whatever is on top of the stack
+ ****************************************************************************/
+static void charge(void) {
+  uint64_t now    = riscv_cycles();
+  uint32_t stalls = riscv_stalled_count();
+
+  if(depth > 0) {
+    struct node *n = nodes + stack[depth-1].node;
+    n->cycles += now - last_cycles;
+    n->stalls += stalls - last_stalls;
+  }
+  last_cycles = now;
+  last_stalls = stalls;
+}
+
+/****************************************************************************
+ * Find (or add) the node for calling func from parent
+ ****************************************************************************/
+static uint32_t child(uint32_t parent, uint32_t func) {
+  uint32_t i;
+
+  for(i = nodes[parent].child; i != 0; i = nodes[i].sibling) {
+    if(nodes[i].func == func)
+      return i;
+  }
+
+  if(n_nodes == max_nodes) {
+    struct node *n = realloc(nodes, 2 * max_nodes * sizeof(struct node));
+    if(n == NULL)
+      return parent;
+    nodes = n;
+    max_nodes *= 2;
+  }
+
+  i = n_nodes++;
+  memset(nodes+i, 0, sizeof(struct node));
+  nodes[i].func    = func;
+  nodes[i].parent  = parent;
+  nodes[i].sibling = nodes[parent].child;
+  nodes[parent].child = i;
+  return i;
+}
+
+/****************************************************************************/
+static void push(uint32_t func, uint32_t ret, int trap) {
+  if(depth == PROFILE_MAX_DEPTH) {
+    overflows++;
+    return;
+  }
+  stack[depth].node = child(stack[depth-1].node, func);
+  stack[depth].ret  = ret;
+  stack[depth].trap = trap;
+  depth++;
+}
+
+/****************************************************************************
+ * Pop back to the frame that returns to target. If there isn't one (say
+ * after a longjmp) just drop the top frame. Never unwinds past a trap.
+ ****************************************************************************/
+static void pop(uint32_t target) {
+  int i;
+
+  for(i = depth-1; i > 0 && !stack[i].trap; i--) {
+    if(stack[i].ret == target) {
+      depth = i;
+      return;
+    }
+  }
+  if(depth > 1 && !stack[depth-1].trap)
+    depth--;
+}
+
+/****************************************************************************/
+int profile_start(void) {
+  max_nodes = 1024;
+  nodes = malloc(max_nodes * sizeof(struct node));
+  if(nodes == NULL)
+    return 0;
+  memset(nodes, 0, sizeof(struct node));
+  n_nodes = 1;
+  depth   = 0;
+  profile_active = 1;
+  return 1;
+}
+
+/****************************************************************************
+ * Start again from the bottom, running from entry
+ ****************************************************************************/
+void profile_reset(uint32_t entry) {
+  charge();
+  stack[0].node = child(PROFILE_ROOT, entry);
+  stack[0].ret  = 0;
+  stack[0].trap = 0;
+  depth = 1;
+}
+
+/****************************************************************************
+ * Called after every JAL and JALR with where it went, the address after
+ * it, and its destination and source registers (rs1 is -1 for a JAL)
+ ****************************************************************************/
+void profile_jump(uint32_t target, uint32_t next, int rd, int rs1) {
+  int rd_link  = (rd  == REG_RA || rd  == REG_T0);
+  int rs1_link = (rs1 == REG_RA || rs1 == REG_T0);
+
+  if(!rd_link && !rs1_link)
+    return;
+
+  charge();
+  if(rs1_link && (!rd_link || rd != rs1))
+    pop(target);
+  if(rd_link)
+    push(target, next, 0);
+}
+
+/****************************************************************************/
+void profile_trap(uint32_t handler, uint32_t epc) {
+  charge();
+  push(handler, epc, 1);
+}
+
+/****************************************************************************/
+void profile_mret(void) {
+  int i;
+
+  charge();
+  for(i = depth-1; i > 0; i--) {
+    if(stack[i].trap) {
+      depth = i;
+      return;
+    }
+  }
+}
+
+/****************************************************************************/
+static void write_node(FILE *f, uint32_t i, char *path, int len, int *lines) {
+  struct node *n = nodes + i;
+  uint32_t c;
+
+  if(i != PROFILE_ROOT) {
+    if(len > 0)
+      path[len++] = ';';
+    symbols_format(n->func, path+len, PROFILE_MAX_NAME);
+    len += strlen(path+len);
+
+    if(n->cycles > n->stalls) {
+      fprintf(f, "%s %llu\n", path, (unsigned long long)(n->cycles - n->stalls));
+      (*lines)++;
+    }
+    if(n->stalls > 0) {
+      fprintf(f, "%s;[stalled] %llu\n", path, (unsigned long long)n->stalls);
+      (*lines)++;
+    }
+  }
+
+  for(c = n->child; c != 0; c = nodes[c].sibling)
+    write_node(f, c, path, len, lines);
+}
+
+/****************************************************************************
+ * Write the folded stacks, one "frame;frame;frame cycles" line per path
+ ****************************************************************************/
+int profile_write(const char *fname) {
+  char buffer[300];
+  char *path;
+  int lines = 0;
+  FILE *f;
+
+  if(!profile_active)
+    return 0;
+  charge();
+
+  f = fopen(fname, "w");
+  if(f == NULL) {
+    snprintf(buffer, sizeof(buffer), "Unable to open profile '%s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  path = malloc(PROFILE_MAX_DEPTH * (PROFILE_MAX_NAME+1));
+  if(path == NULL) {
+    fclose(f);
+    return 0;
+  }
+  path[0] = '\0';
+  write_node(f, PROFILE_ROOT, path, 0, &lines);
+  free(path);
+  fclose(f);
+
+  snprintf(buffer, sizeof(buffer), "Profile of %u call paths written to '%s' (%i lines)",
+           n_nodes-1, fname, lines);
+  display_log(buffer);
+  if(overflows) {
+    snprintf(buffer, sizeof(buffer), "Profile call stack overflowed %u times", overflows);
+    display_log(buffer);
+  }
+  return 1;
+}
+
+/****************************************************************************/
+void profile_finish(void) {
+  free(nodes);
+  nodes = NULL;
+  profile_active = 0;
+}
+/****************************************************************************/
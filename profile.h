@@ -0,0 +1,13 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+/* Set while profiling, so the CPU only calls in when it is wanted */
+extern int profile_active;
+
+int  profile_start(void);
+void profile_reset(uint32_t entry);
+void profile_jump(uint32_t target, uint32_t next, int rd, int rs1);
+void profile_trap(uint32_t handler, uint32_t epc);
+void profile_mret(void);
+int  profile_write(const char *fname);
+void profile_finish(void);
+#endif
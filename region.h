@@ -7,5 +7,13 @@ struct region {
 		    int  (*get)(struct region *r, uint32_t address, uint32_t *value);
 		      void (*free)(struct region *r);
 		        void (*dump)(struct region *r);
+			  int  (*load)(struct region *r, uint32_t address, const uint8_t *src, uint32_t len);
+			  int  (*pure)(struct region *r, uint32_t address);	/* Reading has no side effects */
 			  void *data;
+			  char *name;
+			  char *options;
+			  uint32_t *dirty;
+			  uint32_t latency;
+			  uint8_t  executable;
+			  uint8_t  cacheable;
 };
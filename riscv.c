@@ -13,32 +13,123 @@
 #include "display.h"
 #include "string.h"
 #include "memory.h"
+#include "memorymap.h"
+#include "event.h"
+#include "profile.h"
+#include "symbols.h"
+#include "hotspot.h"
+#include "log.h"
+#include "bpred.h"
+#include "cache.h"
+#include "timing.h"
 
 #define ALLOW_RV32M 1
 
+#define CSR_MSTATUS    (0x300)
+#define CSR_MISA       (0x301)
+#define CSR_MIE        (0x304)
+#define CSR_MTVEC      (0x305)
+#define CSR_MHPMEVENT  (0x320)
+#define CSR_MSCRATCH   (0x340)
+#define CSR_MEPC       (0x341)
+#define CSR_MCAUSE     (0x342)
+#define CSR_MTVAL      (0x343)
+#define CSR_MIP        (0x344)
+#define CSR_PMPCFG     (0x3A0)
+#define CSR_PMPADDR    (0x3B0)
 #define CSR_MCYCLE     (0xB00)
+#define CSR_MCYCLEH    (0xB80)
 #define CSR_RDCYCLE    (0xC00)
-#define CSR_RDTIME     (0xC01)
-#define CSR_RDINSTRET  (0xC02) 
-#define CSR_RDCYCLEH   (0xC83)
-#define CSR_RDTIMEH    (0xC81)
-#define CSR_RDINSTRETH (0xC82) 
-#define CSR_MCPUID     (0xF00)
-#define CSR_MIMPID     (0xF01)
+#define CSR_RDCYCLEH   (0xC80)
+#define CSR_MVENDORID  (0xF11)
+#define CSR_MARCHID    (0xF12)
+#define CSR_MIMPID     (0xF13)
+#define CSR_MHARTID    (0xF14)
 
 /* CPU State info */
-uint32_t csr[0x1000];
 uint32_t regs[32];
 uint32_t pc;
+static uint32_t reset_pc = 0x20400000;
 /* Processor state outside of registers */
 static uint8_t  stalled;
 static uint8_t  read_dispatched;
 static uint8_t  fetch_in_progress;
+/* Cycles the CPU is held for - refilling the pipeline after a mispredicted
+ * jump, or waiting for an earlier instruction's result */
+static uint32_t refill;
+
+#define MSTATUS_MIE    (1<<3)
+#define MSTATUS_MPIE   (1<<7)
+#define MSTATUS_MPP    (3<<11)
+
+#define MTVEC_VECTORED (1)
+
+/* Machine mode trap setup and handling CSRs */
+static uint32_t mstatus, mie, mip, mtvec, mscratch, mepc, mcause, mtval;
+static uint32_t pmpcfg[4], pmpaddr[16];
+
+/* Synchronous exception causes */
+#define CAUSE_MISALIGNED_FETCH (0)
+#define CAUSE_ILLEGAL          (2)
+#define CAUSE_BREAKPOINT       (3)
+#define CAUSE_ECALL_M          (11)
+
+/* Set when an interrupt is both pending and enabled */
+static uint8_t  irq_pending;
+/* Set while sleeping in WFI */
+static uint8_t  waiting;
 
 /* Misc info */
-uint32_t stalled_count;
+static uint64_t cycle_count;
+static uint64_t idle_cycles;
+
+/* Polling loop detection - the state seen at the last backward branch */
+#define POLL_LOOP_MAX_BYTES (32)
+static struct {
+  uint32_t head;
+  uint32_t regs[32];
+  uint64_t cycle;
+  uint64_t started;       /* And the other totals, so skipped iterations */
+  uint64_t loads;         /* still show up in the counters */
+  uint64_t branches;
+  uint64_t stalled;
+  uint64_t mmio;
+  uint64_t impure;        /* Reads with side effects, which stop a skip */
+  uint32_t side_effects;
+  uint8_t  valid;
+} poll_loop;
+static uint32_t side_effects;
+static uint64_t poll_skipped_cycles;
+static uint32_t poll_skips;
+static uint64_t stalled_count;
 int trace_active = 1;
 
+/****************************************************************************
+ * Performance counters.
+ *
+ * Rather than bumping every counter CSR each cycle, a few totals are kept
+ * as things happen and the counters are worked out from them when read.
+ * Writing a counter just records how far it is from its total. The event
+ * each mhpmcounter counts is fixed, so mhpmevent is read only.
+ ****************************************************************************/
+#define COUNTER_CYCLE     (0)
+#define COUNTER_TIME      (1)
+#define COUNTER_INSTRET   (2)
+#define COUNTER_LOADS     (3)
+#define COUNTER_STORES    (4)
+#define COUNTER_BRANCHES  (5)   /* Conditional branches taken */
+#define COUNTER_STALLS    (6)
+#define COUNTER_MMIO      (7)   /* Bus accesses to peripherals */
+#define N_COUNTERS        (8)
+
+static uint64_t instr_started;  /* Decoded, including the one in flight */
+static uint64_t instr_faulted;  /* Raised an exception, so never retired */
+static uint8_t  instr_in_flight; /* Decoded but not yet finished */
+static uint64_t loads_issued;
+static uint64_t stores_issued;
+static uint64_t branches_taken;
+static uint64_t counter_offset[N_COUNTERS];
+
 
 #define ALU_ADD            ( 0)
 #define ALU_SUB            ( 1)
@@ -92,10 +183,11 @@ static uint32_t upper20, upper7, csrid, uimm, shamt;
 
 /* Function to store the trace in the trace buffer */
 static void trace(char *fmt, uint32_t a, uint32_t b, uint32_t c);
-static void exception( char *reason);
+static int  exception(uint32_t cause, uint32_t tval, char *reason);
 
 /* Functions for running opcodes */
 static int op_unified(void);
+static int csr_initialise(void);
 static int op_auipc(void)   { trace("AUIPC  r%u, x%08x",    rd,  upper20,   0);        return op_unified(); }
 static int op_lui(void)     { trace("LUI    r%u, x%08x",    rd,  upper20,   0);        return op_unified(); }
 static int op_jal(void)     { trace("JAL    r%u, %i",       rd,  jmpoffset, 0);        return op_unified(); }
@@ -153,9 +245,11 @@ static int op_lw(void)      { trace("LW     r%u, r%u + %i", rd,  rs1,       imm1
 static int op_lbu(void)     { trace("LBU    r%u, r%u + %i", rd,  rs1,       imm12);    return op_unified(); }
 static int op_lhu(void)     { trace("LHU    r%u, r%u + %i", rd,  rs1,       imm12);    return op_unified(); }
 
-static int op_ecall(void)   { trace("ECALL",       0,            0,0); exception("Unknown Opcode exception"); return 0; }
-static int op_ebreak(void)  { trace("EBREAK",      0,            0,0); exception("Unknown Opcode exception"); return 0; }
-static int op_unknown(void) { trace("???? (%08x)", current_instr,0,0); exception("Unknown Opcode exception"); return 0; }
+static int op_mret(void);
+static int op_wfi(void);
+static int op_ecall(void)   { trace("ECALL",       0,            0,0); return exception(CAUSE_ECALL_M,  0,             "Environment call"); }
+static int op_ebreak(void)  { trace("EBREAK",      0,            0,0); return exception(CAUSE_BREAKPOINT, pc,           "Breakpoint"); }
+static int op_unknown(void) { trace("???? (%08x)", current_instr,0,0); return exception(CAUSE_ILLEGAL,  current_instr, "Unknown Opcode exception"); }
 
 struct opcode_entry { 
   char *spec;
@@ -219,6 +313,8 @@ struct opcode_entry {
 
    {"00000000000000000000000001110011", op_ecall,    0, ALU_NUL,     0, PC_NEXT_I,        CSR_NOP,  MEM_NONE, 0x00000000, 0x00000000},
    {"00000000000100000000000001110011", op_ebreak,   0, ALU_NUL,     0, PC_NEXT_I,        CSR_NOP,  MEM_NONE, 0x00000000, 0x00000000},
+   {"00110000001000000000000001110011", op_mret,     0, ALU_NUL,     0, PC_NEXT_I,        CSR_NOP,  MEM_NONE, 0x00000000, 0x00000000},
+   {"00010000010100000000000001110011", op_wfi,      0, ALU_NUL,     0, PC_NEXT_I,        CSR_NOP,  MEM_NONE, 0x00000000, 0x00000000},
 
    {"-----------------001-----1110011", op_csrrw,    0, ALU_CSR,     1, PC_NEXT_I,        CSR_RW,   MEM_NONE, 0x00000000, 0x00000000},
    {"-----------------010-----1110011", op_csrrs,    0, ALU_CSR,     1, PC_NEXT_I,        CSR_RS,   MEM_NONE, 0x00000000, 0x00000000},
@@ -248,7 +344,7 @@ uint32_t riscv_pc(void) {
 }
 /****************************************************************************/
 uint32_t riscv_cycle_count(void) {
-  return csr[CSR_RDCYCLE];
+  return cycle_count;
 }
 /****************************************************************************/
 uint32_t riscv_stalled_count(void) {
@@ -300,35 +396,158 @@ static int decode(void) {
   return valid;
 }
 
-/****************************************************************************/
-static void exception( char *reason) {
-  char buffer[200];
-  if(strlen(reason) < 100)
-    sprintf(buffer, "EXCEPTION: %s : instruction 0x%08x", reason, current_instr);
-  else
-    sprintf(buffer, "EXCEPTION: [reason too long] : instruction 0x%08x", current_instr);
-  display_log(reason);
-}	
-
 /****************************************************************************/
 static void trace(char *fmt, uint32_t a, uint32_t b, uint32_t c) {
   char buffer[128];
+  int n;
   if(!trace_active)
     return;
-  sprintf(buffer,"%08X:%c",pc, stalled ? '*' : ' ');
-  sprintf(buffer+10, fmt, a, b, c);
+  if(symbols_count() > 0) {
+    char name[64];
+    symbols_format(pc, name, sizeof(name));
+    n = sprintf(buffer,"%08X %-14.14s%c",pc, name, stalled ? '*' : ' ');
+  } else {
+    n = sprintf(buffer,"%08X:%c",pc, stalled ? '*' : ' ');
+  }
+  sprintf(buffer+n, fmt, a, b, c);
   display_trace(buffer);
 }	
 
+/****************************************************************************/
+static void update_irq(void) {
+  irq_pending = (mstatus & MSTATUS_MIE) && (mip & mie);
+}
+
+/****************************************************************************
+ * Called by devices to raise or lower one of the interrupt lines in mip
+ ****************************************************************************/
+void riscv_set_irq(int irq, int level) {
+  if(level)
+    mip |=  (1u << irq);
+  else
+    mip &= ~(1u << irq);
+  update_irq();
+}
+
+/****************************************************************************
+ * Enter the trap handler. Interrupts go to mtvec + 4*cause when mtvec is
+ * in vectored mode, everything else goes to the base address.
+ ****************************************************************************/
+static void take_trap(uint32_t cause, uint32_t tval) {
+  uint32_t base = mtvec & ~3;
+
+  mepc    = pc;
+  mcause  = cause;
+  mtval   = tval;
+  mstatus = (mstatus & ~(MSTATUS_MIE|MSTATUS_MPIE))
+          | ((mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0)
+          | MSTATUS_MPP;
+
+  if((cause & 0x80000000) && (mtvec & 3) == MTVEC_VECTORED)
+    pc = base + 4*(cause & 0x7FFFFFFF);
+  else
+    pc = base;
+  update_irq();
+  if(profile_active)
+    profile_trap(pc, mepc);
+}
+
+/****************************************************************************/
+static void take_interrupt(void) {
+  uint32_t pending = mip & mie;
+  int cause;
+
+  /* Priority order is external, software then timer */
+  if(pending & (1u << IRQ_M_EXT))
+    cause = IRQ_M_EXT;
+  else if(pending & (1u << IRQ_M_SOFT))
+    cause = IRQ_M_SOFT;
+  else
+    cause = IRQ_M_TIMER;
+
+  take_trap(0x80000000 | cause, 0);
+  trace("Interrupt cause %i to %08x", cause, pc, 0);
+}
+
+/****************************************************************************
+ * Raise a synchronous exception. If no trap handler has been set up there
+ * is nowhere to go, so log it and stop the CPU as before.
+ ****************************************************************************/
+static int exception(uint32_t cause, uint32_t tval, char *reason) {
+  char buffer[250];
+  char where[64];
+
+  instr_faulted++;
+  instr_in_flight = 0;
+  if(mtvec == 0) {
+    symbols_format(pc, where, sizeof(where));
+    if(strlen(reason) < 100)
+      sprintf(buffer, "EXCEPTION: %s : instruction 0x%08x at %s", reason, current_instr, where);
+    else
+      sprintf(buffer, "EXCEPTION: [reason too long] : instruction 0x%08x at %s", current_instr, where);
+    display_log(buffer);
+    return 0;
+  }
+
+  take_trap(cause, tval);
+  return 1;
+}
+
+/****************************************************************************/
+static int op_mret(void) {
+  trace("MRET", 0, 0, 0);
+  mstatus = (mstatus & ~MSTATUS_MIE)
+          | ((mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0)
+          | MSTATUS_MPIE;
+  pc = mepc;
+  update_irq();
+  if(profile_active)
+    profile_mret();
+  return 1;
+}
+
+/****************************************************************************
+ * Wait for interrupt. The hart sleeps until an enabled interrupt is
+ * pending (even if mstatus.MIE is clear), then carries on after the WFI.
+ ****************************************************************************/
+static int op_wfi(void) {
+  trace("WFI", 0, 0, 0);
+  pc = pc + 4;
+  if((mip & mie) == 0)
+    waiting = 1;
+  return 1;
+}
+
 /****************************************************************************/
 void riscv_reset(void) {
+  /* Before the devices reset, as they may raise their lines again */
+  mip      = 0;
   memory_reset();
   memset(regs,0xFF,sizeof(regs));
   regs[0] = 0;
-  pc = 0x20400000;
+  mstatus  = MSTATUS_MPP;
+  mie      = 0;
+  mcause   = 0;
+  mtvec    = 0;
+  mscratch = 0;
+  mepc     = 0;
+  waiting  = 0;
+  refill   = 0;
+  instr_in_flight = 0;
+  timing_reset();
+  poll_loop.valid = 0;
+  update_irq();
+  pc = reset_pc;
+  if(profile_active)
+    profile_reset(pc);
   display_log("RISC-V reset");
 }
 
+/****************************************************************************/
+void riscv_set_reset_pc(uint32_t address) {
+  reset_pc = address;
+}
+
 /****************************************************************************/
 int riscv_initialise(void) {
   int i;
@@ -360,12 +579,292 @@ int riscv_initialise(void) {
         }
      }
   }
+  return csr_initialise();
+}
+/****************************************************************************
+ * If a short loop goes all the way round without storing anything or
+ * making a read with side effects (say popping a UART's receive FIFO),
+ * and ends up with exactly the same registers, then it will keep doing so
+ * until something outside the CPU changes - and that can only happen
+ * when a device event fires. So skip whole iterations up to the next
+ * event instead of running them.
+ *
+ * Not when something is counting what each instruction does (hot spots,
+ * caches, branch prediction or pipeline timing), as the skipped
+ * iterations would be missing from its report.
+ ****************************************************************************/
+static int poll_loop_skippable(void) {
+  return !hotspot_active && !bpred_active && !timing_active
+      && !cache_enabled(CACHE_I) && !cache_enabled(CACHE_D);
+}
+
+/****************************************************************************/
+static void poll_loop_check(void) {
+  if(poll_loop.valid && poll_loop.head == pc
+     && poll_loop_skippable()
+     && poll_loop.impure == memorymap_impure_reads()
+     && poll_loop.side_effects == side_effects
+     && event_deadline != EVENT_NEVER
+     && !memory_write_pending()
+     && memcmp(poll_loop.regs, regs, sizeof(regs)) == 0) {
+    uint64_t iteration = cycle_count - poll_loop.cycle;
+
+    if(iteration > 0 && event_deadline > cycle_count+1) {
+      uint64_t n = (event_deadline - 1 - cycle_count) / iteration;
+      if(n > 0) {
+        cycle_count    += n * iteration;
+        instr_started  += n * (instr_started  - poll_loop.started);
+        loads_issued   += n * (loads_issued   - poll_loop.loads);
+        branches_taken += n * (branches_taken - poll_loop.branches);
+        stalled_count  += n * (stalled_count  - poll_loop.stalled);
+        memorymap_skip_mmio_accesses(n * (memorymap_mmio_accesses() - poll_loop.mmio));
+        poll_skipped_cycles += n * iteration;
+        poll_skips++;
+      }
+    }
+  }
+
+  poll_loop.head         = pc;
+  poll_loop.cycle        = cycle_count;
+  poll_loop.started      = instr_started;
+  poll_loop.loads        = loads_issued;
+  poll_loop.branches     = branches_taken;
+  poll_loop.stalled      = stalled_count;
+  poll_loop.mmio         = memorymap_mmio_accesses();
+  poll_loop.impure       = memorymap_impure_reads();
+  poll_loop.side_effects = side_effects;
+  poll_loop.valid        = 1;
+  memcpy(poll_loop.regs, regs, sizeof(regs));
+}
+
+/****************************************************************************
+ * The running total behind a counter. Only read by CSR instructions, which
+ * haven't retired themselves yet.
+ ****************************************************************************/
+static uint64_t counter_total(int n) {
+  switch(n) {
+    case COUNTER_CYCLE:    return cycle_count;
+    case COUNTER_TIME:     return cycle_count;
+    case COUNTER_INSTRET:  return instr_started - instr_faulted - instr_in_flight;
+    case COUNTER_LOADS:    return loads_issued;
+    case COUNTER_STORES:   return stores_issued;
+    case COUNTER_BRANCHES: return branches_taken;
+    case COUNTER_STALLS:   return stalled_count;
+    case COUNTER_MMIO:     return memorymap_mmio_accesses();
+    default:               return 0;
+  }
+}
+
+/****************************************************************************/
+static uint64_t counter_value(int n) {
+  if(n >= N_COUNTERS)
+    return 0;
+  return counter_total(n) + counter_offset[n];
+}
+
+/****************************************************************************
+ * Set the low or high half of a counter. Time and unimplemented counters
+ * can't be changed.
+ ****************************************************************************/
+static void counter_set(int n, int high, uint32_t value) {
+  uint64_t v;
+
+  if(n >= N_COUNTERS || n == COUNTER_TIME)
+    return;
+  v = counter_value(n);
+  if(high)
+    v = (v & 0xFFFFFFFF) | ((uint64_t)value << 32);
+  else
+    v = (v & 0xFFFFFFFF00000000ULL) | value;
+  counter_offset[n] = v - counter_total(n);
+  /* The value written replaces the count for the writing instruction */
+  if(n == COUNTER_INSTRET)
+    counter_offset[n]--;
+}
+
+/****************************************************************************
+ * CSRs.
+ *
+ * Each implemented CSR has a slot in csrs[], found through csr_slot[] by
+ * its number (slot 0 means it doesn't exist, so accessing it is an illegal
+ * instruction). The slot has the handlers to call, the bits that can be
+ * written and where the value lives, so an access is an index and a call.
+ *
+ * The slots are filled in by riscv_initialise() from csr_defs[], where a
+ * run of alike CSRs (e.g. the counters) takes one line. CSRs numbered
+ * 0xC00 and up are read only, as the spec says. There is only machine mode,
+ * so every CSR is accessible.
+ ****************************************************************************/
+#define CSR_COUNT      (0x1000)
+#define CSR_MAX_SLOTS  (256)
+#define CSR_READ_ONLY(id) (((id) >> 10) == 3)
+
+struct csr;
+struct csr_def {
+  uint16_t id;
+  uint16_t count;     /* How many in a row, from id */
+  uint32_t wmask;     /* Bits that can be written */
+  uint32_t *store;    /* Where the first one's value lives, or NULL for zero */
+  uint32_t (*read)(const struct csr *c);
+  void     (*write)(const struct csr *c, uint32_t value);
+};
+
+struct csr {
+  const struct csr_def *def;
+  uint32_t *store;
+  uint16_t id;
+};
+
+/* RV32IM */
+static uint32_t misa = (1u << 30) | (1u << ('I'-'A')) | (1u << ('M'-'A'));
+
+#define MSTATUS_WMASK (MSTATUS_MIE|MSTATUS_MPIE)
+#define MIE_WMASK     ((1u<<IRQ_M_SOFT)|(1u<<IRQ_M_TIMER)|(1u<<IRQ_M_EXT))
+
+static uint32_t csr_plain_read(const struct csr *c);
+static void     csr_plain_write(const struct csr *c, uint32_t value);
+static void     csr_irq_write(const struct csr *c, uint32_t value);
+static uint32_t csr_counter_read(const struct csr *c);
+static void     csr_counter_write(const struct csr *c, uint32_t value);
+static uint32_t csr_event_read(const struct csr *c);
+
+static const struct csr_def csr_defs[] = {
+  /* id                n  wmask          store      read              write */
+  {CSR_MSTATUS,        1, MSTATUS_WMASK, &mstatus,  csr_plain_read,   csr_irq_write},
+  {CSR_MISA,           1, 0x00000000,    &misa,     csr_plain_read,   csr_plain_write},
+  {CSR_MIE,            1, MIE_WMASK,     &mie,      csr_plain_read,   csr_irq_write},
+  {CSR_MTVEC,          1, 0xFFFFFFFD,    &mtvec,    csr_plain_read,   csr_plain_write},
+  {CSR_MHPMEVENT+3,   29, 0x00000000,    NULL,      csr_event_read,   csr_plain_write},
+  {CSR_MSCRATCH,       1, 0xFFFFFFFF,    &mscratch, csr_plain_read,   csr_plain_write},
+  {CSR_MEPC,           1, 0xFFFFFFFC,    &mepc,     csr_plain_read,   csr_plain_write},
+  {CSR_MCAUSE,         1, 0xFFFFFFFF,    &mcause,   csr_plain_read,   csr_plain_write},
+  {CSR_MTVAL,          1, 0xFFFFFFFF,    &mtval,    csr_plain_read,   csr_plain_write},
+  /* Set by the devices, so can't be written */
+  {CSR_MIP,            1, 0x00000000,    &mip,      csr_plain_read,   csr_plain_write},
+  /* Kept so start up code can set them, but not enforced */
+  {CSR_PMPCFG,         4, 0xFFFFFFFF,    pmpcfg,    csr_plain_read,   csr_plain_write},
+  {CSR_PMPADDR,       16, 0xFFFFFFFF,    pmpaddr,   csr_plain_read,   csr_plain_write},
+  /* mcycle, minstret and mhpmcounter3-31, then the user mode shadows */
+  {CSR_MCYCLE,         1, 0xFFFFFFFF,    NULL,      csr_counter_read, csr_counter_write},
+  {CSR_MCYCLE+2,      30, 0xFFFFFFFF,    NULL,      csr_counter_read, csr_counter_write},
+  {CSR_MCYCLEH,        1, 0xFFFFFFFF,    NULL,      csr_counter_read, csr_counter_write},
+  {CSR_MCYCLEH+2,     30, 0xFFFFFFFF,    NULL,      csr_counter_read, csr_counter_write},
+  {CSR_RDCYCLE,       32, 0x00000000,    NULL,      csr_counter_read, csr_plain_write},
+  {CSR_RDCYCLEH,      32, 0x00000000,    NULL,      csr_counter_read, csr_plain_write},
+  /* mvendorid, marchid, mimpid and mhartid are all zero */
+  {CSR_MVENDORID,      4, 0x00000000,    NULL,      csr_plain_read,   csr_plain_write},
+};
+
+static struct csr csrs[CSR_MAX_SLOTS];
+static uint8_t    csr_slot[CSR_COUNT];
+
+/****************************************************************************/
+static uint32_t csr_plain_read(const struct csr *c) {
+  return c->store ? *c->store : 0;
+}
+
+/****************************************************************************/
+static void csr_plain_write(const struct csr *c, uint32_t value) {
+  if(c->store == NULL || c->def->wmask == 0)
+    return;
+  *c->store = (*c->store & ~c->def->wmask) | (value & c->def->wmask);
+}
+
+/****************************************************************************
+ * mstatus and mie can change whether an interrupt should be taken
+ ****************************************************************************/
+static void csr_irq_write(const struct csr *c, uint32_t value) {
+  csr_plain_write(c, value);
+  update_irq();
+}
+
+/****************************************************************************/
+static uint32_t csr_counter_read(const struct csr *c) {
+  uint64_t v = counter_value(c->id & 0x1F);
+  return (c->id & 0x80) ? v >> 32 : v;
+}
+
+/****************************************************************************/
+static void csr_counter_write(const struct csr *c, uint32_t value) {
+  counter_set(c->id & 0x1F, (c->id & 0x80) != 0, value);
+}
+
+/****************************************************************************
+ * Each mhpmcounter counts a fixed event, numbered the same as the counter
+ ****************************************************************************/
+static uint32_t csr_event_read(const struct csr *c) {
+  uint32_t n = c->id & 0x1F;
+  return (n >= COUNTER_LOADS && n < N_COUNTERS) ? n : 0;
+}
+
+/****************************************************************************
+ * Give every CSR in csr_defs[] its slot
+ ****************************************************************************/
+static int csr_initialise(void) {
+  int i, n_slots = 1;
+
+  memset(csr_slot, 0, sizeof(csr_slot));
+  for(i = 0; i < sizeof(csr_defs)/sizeof(struct csr_def); i++) {
+    const struct csr_def *d = csr_defs+i;
+    int j;
+    for(j = 0; j < d->count; j++) {
+      uint32_t id = d->id + j;
+      if(id >= CSR_COUNT || csr_slot[id] != 0 || n_slots == CSR_MAX_SLOTS) {
+        char buffer[100];
+        sprintf(buffer, "Unable to add CSR 0x%03x", id);
+        display_log(buffer);
+        return 0;
+      }
+      csrs[n_slots].def   = d;
+      csrs[n_slots].store = d->store ? d->store + j : NULL;
+      csrs[n_slots].id    = id;
+      csr_slot[id] = n_slots++;
+    }
+  }
   return 1;
 }
+
+/****************************************************************************
+ * Which registers the decoded instruction reads, as a bitmask
+ ****************************************************************************/
+static uint32_t source_regs(void) {
+  switch(current_instr & 0x7F) {
+    case 0x67:                          /* JALR */
+    case 0x03:                          /* Loads */
+    case 0x13:  return 1u << rs1;       /* ALU with immediate */
+    case 0x23:                          /* Stores */
+    case 0x63:                          /* Branches */
+    case 0x33:  return (1u << rs1) | (1u << rs2);
+    case 0x73:  return ((current_instr >> 12) & 7) < 4 ? 1u << rs1 : 0;
+    default:    return 0;               /* LUI, AUIPC, JAL, FENCE */
+  }
+}
+
+/****************************************************************************/
+static int timing_class(void) {
+  switch(op->alu_mode) {
+    case ALU_MUL:
+    case ALU_MULH:
+    case ALU_MULHSU:
+    case ALU_MULHU: return TIMING_MUL;
+    case ALU_DIV:
+    case ALU_DIVU:
+    case ALU_REM:
+    case ALU_REMU:  return TIMING_DIV;
+  }
+  if(op->memory_mode == MEM_LOAD)
+    return TIMING_LOAD;
+  if(op->csr_mode != CSR_NOP)
+    return TIMING_CSR;
+  return TIMING_ALU;
+}
+
 /****************************************************************************/
 static int op_unified(void) {
   uint32_t op1, op2, res, csr_res; 
   uint32_t pc_next_i, pc_cond_jump, pc_rel_jump, pc_indirect; 
+  const struct csr *c = NULL;
+  int csr_writes = 0;
 
   /*******************************************************
    * Build local variables based on global state 
@@ -380,6 +879,22 @@ static int op_unified(void) {
   op1 = regs[rs1];
   op2 = op->op2_immediate ? imm12 : regs[rs2];
 
+  /* Check a CSR access is allowed before anything changes. Setting or
+   * clearing no bits isn't a write, so can be done to read only CSRs */
+  if(op->csr_mode != CSR_NOP) {
+    switch(op->csr_mode) {
+      case CSR_RS:
+      case CSR_RC:  csr_writes = (rs1 != 0);   break;
+      case CSR_RSI:
+      case CSR_RCI: csr_writes = (uimm != 0);  break;
+      default:      csr_writes = 1;            break;
+    }
+    c = csrs + csr_slot[csrid];
+    if(c == csrs || (csr_writes && CSR_READ_ONLY(csrid)))
+      return exception(CAUSE_ILLEGAL, current_instr, "Illegal CSR access");
+    log_msg(LOG_CPU, LOG_TRACE, "CSR 0x%03x accessed", csrid);
+  }
+
   /* Find the results */
   switch(op->alu_mode) {
     case ALU_ADD:    res = op1 + op2;                                               break;
@@ -408,26 +923,20 @@ static int op_unified(void) {
     case ALU_NEXT_I: res = pc_next_i;                                             break;
     case ALU_PC_U20: res = pc + upper20;                                          break;
     case ALU_U20:    res = upper20;                                               break;
-    case ALU_CSR:    res = csr[csrid];                                            break;
+    case ALU_CSR:    res = c->def->read(c);                                       break;
     default:         res = 0;                                                     break; 
   }
 
   switch(op->csr_mode) {
     case CSR_RW:  csr_res = regs[rs1];               break;
-    case CSR_RS:  csr_res = csr[csrid] | regs[rs1];  break;
-    case CSR_RC:  csr_res = csr[csrid] & ~regs[rs1]; break;
+    case CSR_RS:  csr_res = res | regs[rs1];         break;
+    case CSR_RC:  csr_res = res & ~regs[rs1];        break;
     case CSR_RWI: csr_res = uimm;                    break;
-    case CSR_RSI: csr_res = csr[csrid] | uimm;       break;
-    case CSR_RCI: csr_res = csr[csrid] & ~uimm;      break;
+    case CSR_RSI: csr_res = res | uimm;              break;
+    case CSR_RCI: csr_res = res & ~uimm;             break;
     default:      csr_res = 0;                       break;
   }
 
-  if(op->csr_mode != CSR_NOP) { 
-    char buffer[100];
-    sprintf(buffer,"CSR 0x%03x accessed",csrid);
-    display_log(buffer);
-  }
-
   /* And now do the write */
   if(op->memory_mode == MEM_STORE) {
     if(memory_write_full()) {
@@ -464,6 +973,7 @@ static int op_unified(void) {
       if(!memory_write_request(addr, op->memory_mask, regs[rs2])) {
         return 0;
       }
+      stores_issued++;
     }
   }
   
@@ -501,6 +1011,7 @@ static int op_unified(void) {
 
         if(memory_read_request(regs[rs1]+imm12)) {
           read_dispatched = 1;
+          loads_issued++;
         } 
         /* Unable to queue request -  will retry */
       } else {
@@ -521,29 +1032,54 @@ static int op_unified(void) {
 
   /* Store the results? */
   if(!stalled) {
+    uint32_t pc_next;
+    int taken = 0;
+
+    /* Which instruction next? */
+    switch(op->pc_mode) {
+      case PC_NEXT_I:        pc_next = pc_next_i;                                    break;
+      case PC_COND_JUMP:     pc_next = res ? pc_cond_jump : pc_next_i; taken =  res; break;
+      case PC_COND_JUMP_INV: pc_next = res ? pc_next_i : pc_cond_jump; taken = !res; break;
+      case PC_REL_JUMP:      pc_next = pc_rel_jump;                                  break;
+      case PC_INDIRECT:      pc_next = pc_indirect;                                  break;
+      default:               pc_next = pc;                                           break;
+    }
+
+    /* A jump to unaligned code traps at the jump, which then doesn't happen */
+    if((pc_next & 3) != 0)
+      return exception(CAUSE_MISALIGNED_FETCH, pc_next, "Jump to unaligned code");
+
     if(op->store_result && rd != 0)
       regs[rd] = res;
+    if(timing_active && op->store_result)
+      timing_complete(rd, timing_class(), cycle_count);
 
     /* Any CSR updates? */
-    switch(op->csr_mode) {
-      case CSR_RW:  if(rs1 != 0) csr[csrid] = csr_res;  break;
-      case CSR_RS:  if(rs1 != 0) csr[csrid] = csr_res;  break;
-      case CSR_RC:  if(rs1 != 0) csr[csrid] = csr_res;  break;
-      case CSR_RWI: csr[csrid] = csr_res;               break;
-      case CSR_RSI: csr[csrid] = csr_res;               break;
-      case CSR_RCI: csr[csrid] = csr_res;               break;
-      default:                                          break;
-    }
+    if(csr_writes)
+      c->def->write(c, csr_res);
 
-    /* Which instruction next? */
-    switch(op->pc_mode) {
-      case PC_NEXT_I:        pc = pc_next_i;                      break;
-      case PC_COND_JUMP:     pc = res ? pc_cond_jump : pc_next_i; break;
-      case PC_COND_JUMP_INV: pc = res ? pc_next_i : pc_cond_jump; break;
-      case PC_REL_JUMP:      pc = pc_rel_jump;                    break;
-      case PC_INDIRECT:      pc = pc_indirect;                    break;
-      default:                                                    break;
+    pc = pc_next;
+    branches_taken += taken;
+
+    if(profile_active && (op->pc_mode == PC_REL_JUMP || op->pc_mode == PC_INDIRECT))
+      profile_jump(pc, pc_next_i, rd, op->pc_mode == PC_INDIRECT ? rs1 : -1);
+
+    if(bpred_active) {
+      switch(op->pc_mode) {
+        case PC_COND_JUMP:     refill += bpred_branch(pc_next_i-4, pc_cond_jump, res != 0); break;
+        case PC_COND_JUMP_INV: refill += bpred_branch(pc_next_i-4, pc_cond_jump, res == 0); break;
+        case PC_REL_JUMP:      refill += bpred_jump(pc_next_i-4, pc, pc_next_i, rd, -1);    break;
+        case PC_INDIRECT:      refill += bpred_jump(pc_next_i-4, pc, pc_next_i, rd, rs1);   break;
+        default:                                                                            break;
+      }
     }
+
+    if(op->memory_mode == MEM_STORE || op->csr_mode != CSR_NOP)
+      side_effects++;
+
+    /* A short backward jump could be a polling loop */
+    if(pc < pc_next_i && pc_next_i - pc <= POLL_LOOP_MAX_BYTES)
+      poll_loop_check();
   }
   return 1;
 }
@@ -551,7 +1087,13 @@ static int op_unified(void) {
 /****************************************************************************/
 static int do_op(void) {
   int i;
-  if((pc & 3) != 0) {
+  if(refill > 0) {
+    refill--;
+    return 1;
+  }
+
+  /* Jumps trap before getting here, so this can only be the reset address */
+  if((pc & 3) != 0 && !stalled && !fetch_in_progress) {
     display_log("Attempt to execute unaligned code");
     return 0;
   }
@@ -559,6 +1101,10 @@ static int do_op(void) {
   if(!stalled) {
     /* Fetch */
     if(!fetch_in_progress) {
+      /* Between instructions, so see if an interrupt should be taken */
+      if(irq_pending)
+        take_interrupt();
+
       if(!memory_fetch_request(pc)) {
         display_log("Unable to fetch instruction");
         return 0;
@@ -568,14 +1114,26 @@ static int do_op(void) {
       fetch_in_progress = 0;
 
       current_instr = memory_fetch_data();
-      /* Decode */
-      if(!decode()) 
-        return 0;
+      /* Decode - there is no C extension, so anything else is illegal */
+      instr_started++;
+      instr_in_flight = 1;
+      if(!decode())
+        return exception(CAUSE_ILLEGAL, current_instr, "Compressed or invalid instruction");
+      if(hotspot_active)
+        hotspot_exec(pc);
+      if(timing_active)
+        refill += timing_issue(source_regs(), cycle_count + refill);
     }
   } 
 
   if(stalled || fetch_in_progress) {
     stalled_count++;
+    if(hotspot_active) {
+      if(fetch_in_progress)
+        hotspot_stall(pc, HOTSPOT_FETCH);
+      else
+        hotspot_stall(pc, op->memory_mode == MEM_STORE ? HOTSPOT_STORE : HOTSPOT_LOAD);
+    }
   }
 
   if(fetch_in_progress) {
@@ -586,8 +1144,12 @@ static int do_op(void) {
   /* Execute */
   for(i = 0; i < sizeof(opcodes)/sizeof(struct opcode_entry); i++) {
      if((current_instr & opcodes[i].mask) == opcodes[i].value) {
+       int rtn;
        op = opcodes+i;
-       return op->func();
+       rtn = op->func();
+       if(!stalled)
+         instr_in_flight = 0;
+       return rtn;
     }
   }
   return 0;
@@ -595,28 +1157,80 @@ static int do_op(void) {
 
 /****************************************************************************/
 uint32_t riscv_cycle_count_l(void) {
-  return csr[CSR_RDCYCLE];
+  return cycle_count;
 }
 
 /****************************************************************************/
 uint32_t riscv_cycle_count_h(void) {
-  return csr[CSR_RDCYCLEH];
+  return cycle_count >> 32;
+}
+
+/****************************************************************************/
+uint64_t riscv_cycles(void) {
+  return cycle_count;
+}
+
+/****************************************************************************/
+int riscv_waiting(void) {
+  return waiting;
+}
+
+/****************************************************************************/
+uint64_t riscv_idle_cycles(void) {
+  return idle_cycles;
+}
+
+/****************************************************************************/
+uint64_t riscv_poll_skipped_cycles(void) {
+  return poll_skipped_cycles;
+}
+
+/****************************************************************************
+ * Nothing can happen while waiting for an interrupt until a device event
+ * fires, so jump the counters straight to the next one. Stores still in
+ * the write FIFO could change when that is (say a new mtimecmp), so stay
+ * awake until they have gone.
+ ****************************************************************************/
+static void idle_fast_forward(void) {
+  uint64_t skip;
+
+  if(event_deadline == EVENT_NEVER || event_deadline <= cycle_count+1
+     || memory_write_pending())
+    return;
+
+  skip = event_deadline - (cycle_count+1);
+  cycle_count += skip;
+  idle_cycles += skip;
 }
 
 /****************************************************************************/
 int riscv_run(void) {
+  if(waiting) {
+    if(mip & mie)
+      waiting = 0;
+    else
+      idle_fast_forward();
+  }
+
   ///////////////////////////////////////
   // Update counters 
   ////////////////////////////////////
-  csr[CSR_RDCYCLE]++;
-  if(csr[CSR_RDCYCLE] == 0)
-    csr[CSR_RDCYCLEH]++;
-  csr[CSR_MCYCLE] = csr[CSR_RDCYCLE];
+  cycle_count++;
+
+  /* Let any devices that are due do their thing */
+  if(cycle_count >= event_deadline)
+    event_run(cycle_count);
+
+  if(waiting) {
+    /* Still asleep - could be woken by the event just run */
+    if((mip & mie) == 0) {
+      idle_cycles++;
+      return 1;
+    }
+    waiting = 0;
+  }
 
   if(do_op()) {
-    csr[CSR_RDTIME]++;
-    if(csr[CSR_RDTIME] == 0)
-      csr[CSR_RDTIMEH]++;
     return 1;
   } else {
     char buffer[100];
@@ -641,5 +1255,18 @@ void riscv_dump(void) {
 }
 /****************************************************************************/
 void riscv_finish(void) {
+  char buffer[100];
+  sprintf(buffer, "Idle in WFI for %llu of %llu cycles",
+          (unsigned long long)idle_cycles, (unsigned long long)cycle_count);
+  display_log(buffer);
+  sprintf(buffer, "Skipped %llu cycles in %u polling loops",
+          (unsigned long long)poll_skipped_cycles, poll_skips);
+  display_log(buffer);
+  sprintf(buffer, "Retired %llu instructions, %llu loads, %llu stores, %llu branches taken",
+          (unsigned long long)(instr_started - instr_faulted - instr_in_flight), (unsigned long long)loads_issued,
+          (unsigned long long)stores_issued, (unsigned long long)branches_taken);
+  display_log(buffer);
+  bpred_finish();
+  timing_finish();
 }
 /****************************************************************************/
@@ -1,8 +1,14 @@
 #ifndef RISCV_H
 #define RISCV_H
+/* Machine mode interrupt numbers (bits in mip and mie) */
+#define IRQ_M_SOFT   (3)
+#define IRQ_M_TIMER  (7)
+#define IRQ_M_EXT    (11)
+
 int riscv_initialise(void);
 int riscv_run(void);
 void riscv_reset(void);
+void riscv_set_reset_pc(uint32_t address);
 void riscv_dump(void);
 uint32_t riscv_cycle_count(void);
 uint32_t riscv_stalled_count(void);
@@ -11,4 +17,9 @@ uint32_t riscv_pc(void);
 void riscv_finish(void);
 uint32_t riscv_cycle_count_l(void);
 uint32_t riscv_cycle_count_h(void);
+uint64_t riscv_cycles(void);
+void riscv_set_irq(int irq, int level);
+int riscv_waiting(void);
+uint64_t riscv_idle_cycles(void);
+uint64_t riscv_poll_skipped_cycles(void);
 #endif
@@ -12,20 +12,19 @@
 #include <stdint.h>
 #include <memory.h>
 #include "region.h"
+#include "config.h"
+#include "loader.h"
 #include "rom.h"
 #include "display.h"
 
 /****************************************************************************/
 static void attempt_to_read(struct region *r) {
-  uint32_t *data;
+  char image[256];
   char *fname;
-  FILE *f;
-  int a = 0;
-  int i;
-
-  data = (uint32_t *)(r->data);
 
-  if(asprintf(&fname, "rom_%08x.img",r->base) < 1) {
+  if(config_option(r->options, "image", image, sizeof(image))) {
+    fname = strdup(image);
+  } else if(asprintf(&fname, "rom_%08x.img",r->base) < 1) {
     display_log("Unable to print file name to memory region");
     return;
   }
@@ -35,73 +34,8 @@ static void attempt_to_read(struct region *r) {
     return;
   }
 
-  f = fopen(fname,"rb");
-  if( f == NULL) {
-    char buffer[100];
-    sprintf(buffer, "File '%s' not present\n",fname);
-    display_log(buffer);
-    free(fname);
-    return;
-  }
+  loader_load_region(r, fname);
   free(fname);
-
-  while(1) {
-    int c;
-    uint32_t d = 0;
- 
-    c = fgetc(f);
-    while(c == '\n' || c == '\r') {
-      c = fgetc(f);
-    }
-
-    if(c == EOF) {
-       printf("End of file at address %i\n", a);
-       break;
-    }
-
-    if(c >= '0' && c <= '9') {
-      d = c - '0';
-    } else if(c >= 'A' && c <= 'F') {
-      d = c - 'A' + 10;
-    } else if(c >= 'a' && c <= 'f') {
-      d = c - 'a' + 10;
-    } else if(c != ' ') {
-      fprintf(stderr, "unexpected characters in file\n");
-      return;
-    }
-
-    for(i = 0; i < 7; i++) {
-      c = fgetc(f);
-      if(c >= '0' && c <= '9') {
-	d *= 16;
-        d += c - '0';
-      } else if(c >= 'A' && c <= 'F') {
-	d *= 16;
-        d += c - 'A' + 10;
-      } else if(c >= 'a' && c <= 'f') {
-	d *= 16;
-        d += c - 'a' + 10;
-      } else if(c == ' ' || c == '\t' || c == '\n') {
-	if(a*4+3 >= r->size) {
-          display_log("Too much data for memory region");
-          return;
-	}
-	break;
-      } else {
-        display_log("unexpected characters in file");
-        return;
-      }
-    }
-
-    data[a] = d;
-    a++;
-
-    while(c != '\n' && c != EOF) {
-      c = fgetc(f);
-    }
-  } 
-
-  fclose(f);
 }
 /****************************************************************************/
 int ROM_init(struct region *r) {
@@ -159,6 +93,19 @@ int ROM_get(struct region *r, uint32_t address, uint32_t *value) {
    return 1;
 }
 
+/****************************************************************************/
+int ROM_load(struct region *r, uint32_t address, const uint8_t *src, uint32_t len) {
+   if(address > r->size || len > r->size - address) {
+     display_log("Too much data for memory region");
+     return 0;
+   }
+   if(src != NULL)
+     memcpy((unsigned char *)r->data + address, src, len);
+   else
+     memset((unsigned char *)r->data + address, 0, len);
+   return 1;
+}
+
 /****************************************************************************/
 void ROM_dump(struct region *r) {
    int i;
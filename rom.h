@@ -1,5 +1,6 @@
 int ROM_init(struct region *r);
 int ROM_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value);
 int ROM_get(struct region *r, uint32_t address, uint32_t *value);
+int ROM_load(struct region *r, uint32_t address, const uint8_t *src, uint32_t len);
 void ROM_dump(struct region *r);
 void ROM_free(struct region *r);
@@ -0,0 +1,350 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "script.h"
+#include "config.h"
+#include "match.h"
+#include "event.h"
+#include "riscv.h"
+#include "display.h"
+
+/****************************************************************************
+ * A script drives the console UART for automated runs. Each line is one
+ * of these, and the steps are worked through in order:
+ *
+ *   send "text"          queue text to be received by the guest
+ *   expect "text"        wait for the guest to send text
+ *   wait CYCLES          wait for a number of cycles
+ *   at CYCLE             wait until an absolute cycle count
+ *   exit CODE            end the run with this exit code
+ *
+ * and these apply for the whole run:
+ *
+ *   stop CODE "text"     end the run as soon as the guest sends text
+ *   timeout CYCLE CODE   end the run if it is still going at CYCLE
+ *
+ * All the expect and stop strings go into one matcher, so the console
+ * output is only looked at once however many there are.
+ ****************************************************************************/
+#define STEP_SEND   0
+#define STEP_EXPECT 1
+#define STEP_WAIT   2
+#define STEP_AT     3
+#define STEP_EXIT   4
+
+#define SCRIPT_MAX_LINE 1024
+
+struct step {
+  int      type;
+  char    *text;
+  int      len;
+  int      pattern;
+  uint64_t cycles;
+  int      code;
+};
+
+struct stop {
+  int pattern;
+  int code;
+};
+
+static struct step *steps;
+static int n_steps;
+static int current;
+
+static struct stop *stops;
+static int n_stops;
+
+static struct matcher *matcher;
+static struct event step_event;
+static struct event timeout_event;
+static int timeout_code;
+
+/* Text waiting to be picked up by the UART */
+static char *rx_buffer;
+static int   rx_size;
+static int   rx_used;
+static int   rx_read;
+
+static int active   = 0;
+static int finished = 0;
+static int exit_code;
+
+/****************************************************************************/
+static void finish(int code, const char *why) {
+  char buffer[200];
+
+  if(finished)
+    return;
+  finished  = 1;
+  exit_code = code;
+  snprintf(buffer, sizeof(buffer), "Script finished at cycle %llu with exit code %i (%s)",
+           (unsigned long long)riscv_cycles(), code, why);
+  display_log(buffer);
+}
+
+/****************************************************************************/
+static int queue_rx(const char *text, int len) {
+  if(rx_read > 0) {
+    memmove(rx_buffer, rx_buffer+rx_read, rx_used-rx_read);
+    rx_used -= rx_read;
+    rx_read = 0;
+  }
+  if(rx_used + len > rx_size) {
+    char *b = realloc(rx_buffer, rx_used + len);
+    if(b == NULL)
+      return 0;
+    rx_buffer = b;
+    rx_size   = rx_used + len;
+  }
+  memcpy(rx_buffer+rx_used, text, len);
+  rx_used += len;
+  return 1;
+}
+
+/****************************************************************************
+ * Carry on through the steps until one has to wait for something
+ ****************************************************************************/
+static void run_steps(uint64_t now) {
+  while(!finished && current < n_steps) {
+    struct step *s = steps+current;
+
+    switch(s->type) {
+      case STEP_SEND:
+        if(!queue_rx(s->text, s->len)) {
+          finish(1, "out of memory");
+          return;
+        }
+        break;
+      case STEP_EXPECT:
+        return;
+      case STEP_WAIT:
+        current++;
+        event_schedule(&step_event, now + s->cycles);
+        return;
+      case STEP_AT:
+        current++;
+        if(s->cycles > now) {
+          event_schedule(&step_event, s->cycles);
+          return;
+        }
+        continue;
+      case STEP_EXIT:
+        finish(s->code, "exit");
+        return;
+    }
+    current++;
+  }
+}
+
+/****************************************************************************/
+static void step_event_func(struct event *e, uint64_t now) {
+  run_steps(now);
+}
+
+/****************************************************************************/
+static void timeout_event_func(struct event *e, uint64_t now) {
+  finish(timeout_code, "timeout");
+}
+
+/****************************************************************************/
+static void found(int id, void *arg) {
+  int i;
+
+  for(i = 0; i < n_stops; i++) {
+    if(stops[i].pattern == id) {
+      finish(stops[i].code, "stop string seen");
+      return;
+    }
+  }
+
+  if(current < n_steps && steps[current].type == STEP_EXPECT
+     && steps[current].pattern == id) {
+    current++;
+    run_steps(riscv_cycles());
+  }
+}
+
+/****************************************************************************
+ * Called with every character the console UART sends
+ ****************************************************************************/
+void script_uart_tx(uint8_t c) {
+  if(!finished)
+    matcher_feed(matcher, c, found, NULL);
+}
+
+/****************************************************************************
+ * Called by the console UART for input, returns how many bytes it got
+ ****************************************************************************/
+int script_uart_rx(uint8_t *data, int len) {
+  if(len > rx_used - rx_read)
+    len = rx_used - rx_read;
+  memcpy(data, rx_buffer+rx_read, len);
+  rx_read += len;
+  return len;
+}
+
+/****************************************************************************/
+int script_active(void) {
+  return active;
+}
+
+/****************************************************************************/
+int script_finished(int *code) {
+  if(finished)
+    *code = exit_code;
+  return finished;
+}
+
+/****************************************************************************/
+static int parse_line(char *line, int line_no) {
+  char *argv[CONFIG_MAX_ARGS];
+  char buffer[100];
+  struct step s;
+  uint64_t when;
+  uint32_t v;
+  int argc;
+
+  argc = config_split(line, argv, CONFIG_MAX_ARGS);
+  if(argc == 0)
+    return 1;
+
+  memset(&s, 0, sizeof(s));
+  s.pattern = -1;
+
+  if(argc == 2 && (strcmp(argv[0], "send") == 0 || strcmp(argv[0], "expect") == 0)) {
+    s.type = (argv[0][0] == 's') ? STEP_SEND : STEP_EXPECT;
+    s.len  = strlen(argv[1]);
+    s.text = strdup(argv[1]);
+    if(s.text == NULL)
+      return 0;
+    if(s.type == STEP_EXPECT) {
+      s.pattern = matcher_add(matcher, s.text, s.len);
+      if(s.pattern < 0)
+        goto bad;
+    }
+  } else if(argc == 2 && strcmp(argv[0], "wait") == 0 && config_number64(argv[1], &when)) {
+    s.type   = STEP_WAIT;
+    s.cycles = when;
+  } else if(argc == 2 && strcmp(argv[0], "at") == 0 && config_number64(argv[1], &when)) {
+    s.type   = STEP_AT;
+    s.cycles = when;
+  } else if(argc == 2 && strcmp(argv[0], "exit") == 0 && config_number(argv[1], &v)) {
+    s.type = STEP_EXIT;
+    s.code = v;
+  } else if(argc == 3 && strcmp(argv[0], "stop") == 0 && config_number(argv[1], &v)) {
+    struct stop *n = realloc(stops, (n_stops+1) * sizeof(struct stop));
+    if(n == NULL)
+      return 0;
+    stops = n;
+    stops[n_stops].code    = v;
+    stops[n_stops].pattern = matcher_add(matcher, argv[2], strlen(argv[2]));
+    if(stops[n_stops].pattern < 0)
+      goto bad;
+    n_stops++;
+    return 1;
+  } else if(argc == 3 && strcmp(argv[0], "timeout") == 0
+            && config_number64(argv[1], &when) && config_number(argv[2], &v)) {
+    timeout_code = v;
+    event_schedule(&timeout_event, when);
+    return 1;
+  } else {
+    goto bad;
+  }
+
+  {
+    struct step *n = realloc(steps, (n_steps+1) * sizeof(struct step));
+    if(n == NULL)
+      return 0;
+    steps = n;
+    steps[n_steps++] = s;
+  }
+  return 1;
+
+bad:
+  if(s.text != NULL)
+    free(s.text);
+  sprintf(buffer, "Script line %i not understood", line_no);
+  display_log(buffer);
+  return 0;
+}
+
+/****************************************************************************/
+int script_load(const char *fname) {
+  char line[SCRIPT_MAX_LINE];
+  char buffer[300];
+  int line_no = 0;
+  FILE *f;
+
+  f = fopen(fname, "r");
+  if(f == NULL) {
+    snprintf(buffer, sizeof(buffer), "Unable to open script '%s'", fname);
+    display_log(buffer);
+    return 0;
+  }
+
+  matcher = matcher_new();
+  if(matcher == NULL) {
+    fclose(f);
+    return 0;
+  }
+  event_init(&step_event, step_event_func, NULL);
+  event_init(&timeout_event, timeout_event_func, NULL);
+
+  while(fgets(line, sizeof(line), f) != NULL) {
+    line_no++;
+    if(!parse_line(line, line_no)) {
+      fclose(f);
+      return 0;
+    }
+  }
+  fclose(f);
+
+  if(!matcher_build(matcher))
+    return 0;
+
+  snprintf(buffer, sizeof(buffer), "Script '%s' loaded - %i steps, %i strings to look for",
+           fname, n_steps, matcher_patterns(matcher));
+  display_log(buffer);
+
+  active = 1;
+  run_steps(riscv_cycles());
+  return 1;
+}
+
+/****************************************************************************/
+void script_finish(void) {
+  int i;
+
+  if(!active)
+    return;
+
+  if(!finished && current < n_steps && steps[current].type == STEP_EXPECT) {
+    char buffer[SCRIPT_MAX_LINE+50];
+    snprintf(buffer, sizeof(buffer), "Script still waiting for \"%s\"", steps[current].text);
+    display_log(buffer);
+  }
+
+  event_cancel(&step_event);
+  event_cancel(&timeout_event);
+  for(i = 0; i < n_steps; i++) {
+    if(steps[i].text != NULL)
+      free(steps[i].text);
+  }
+  free(steps);
+  free(stops);
+  free(rx_buffer);
+  matcher_free(matcher);
+  active = 0;
+}
+/****************************************************************************/
@@ -0,0 +1,9 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+int  script_load(const char *fname);
+int  script_active(void);
+void script_uart_tx(uint8_t c);
+int  script_uart_rx(uint8_t *data, int len);
+int  script_finished(int *code);
+void script_finish(void);
+#endif
@@ -13,30 +13,110 @@
 #include <memory.h>
 #include "region.h"
 #include "ram.h"
+#include "config.h"
+#include "flash.h"
 #include "display.h"
+#include "log.h"
+
+#define SPI_CSID    0x10
+#define SPI_CSMODE  0x18
+#define SPI_FMT     0x40
+#define SPI_TXDATA  0x48
+#define SPI_RXDATA  0x4C
+#define SPI_TXMARK  0x50
+#define SPI_RXMARK  0x54
+#define SPI_IP      0x74
+
+#define SPI_CSMODE_AUTO 0
+#define SPI_CSMODE_HOLD 2
+#define SPI_CSMODE_OFF  3
+
+#define SPI_FMT_DIR_TX  0x08
+
+#define SPI_FIFO_SIZE 8
+
+/****************************************************************************
+ * The SPI controller. Frames written to txdata are clocked straight
+ * through whatever is on chip select 0 (the flash, if there is one) and
+ * the replies queued for rxdata. In AUTO mode the chip select drops after
+ * each frame, so multi-byte commands need csmode set to HOLD.
+ ****************************************************************************/
+struct spi_data {
+  uint8_t *regs;
+  uint8_t  selected;
+  uint8_t  rx_fifo[SPI_FIFO_SIZE];
+  uint8_t  rx_read_ptr;
+  uint8_t  rx_count;
+};
+
+/****************************************************************************/
+static uint32_t reg_get(struct spi_data *data, uint32_t address) {
+  uint8_t *p = data->regs + address;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/****************************************************************************/
+static void deselect(struct spi_data *data) {
+  if(data->selected) {
+    flash_deselect();
+    data->selected = 0;
+  }
+}
+
+/****************************************************************************/
+static void transfer(struct spi_data *data, uint8_t out) {
+  uint32_t mode = reg_get(data, SPI_CSMODE) & 3;
+  uint8_t in = 0xFF;
+
+  if(mode != SPI_CSMODE_OFF && reg_get(data, SPI_CSID) == 0) {
+    if(!data->selected) {
+      flash_select();
+      data->selected = 1;
+    }
+    in = flash_transfer(out);
+    if(mode == SPI_CSMODE_AUTO)
+      deselect(data);
+  }
+
+  /* Nothing is received when the direction is transmit only */
+  if(!(reg_get(data, SPI_FMT) & SPI_FMT_DIR_TX) && data->rx_count < SPI_FIFO_SIZE) {
+    data->rx_fifo[(data->rx_read_ptr + data->rx_count) % SPI_FIFO_SIZE] = in;
+    data->rx_count++;
+  }
+}
 
 /****************************************************************************/
 int SPI_init(struct region *r) {
-  uint32_t *data;
+  struct spi_data *data;
 
   if(r->data != NULL) {
     display_log("SPI already initialized");
     return 0;
   }
+  if(r->size < SPI_IP+4) {
+    display_log("SPI region is too small");
+    return 0;
+  }
  
-  data = malloc(r->size);
+  data = malloc(sizeof(struct spi_data));
   if(data == NULL){
     return 0;
   }
+  memset(data, 0, sizeof(struct spi_data));
+  data->regs = malloc(r->size);
+  if(data->regs == NULL){
+    free(data);
+    return 0;
+  }
+  memset(data->regs, 0, r->size);
   r->data = (void *)data;
-  memset(r->data, 0, r->size);
   display_log("Set up SPI region");
   return 1;
 }
 
 /****************************************************************************/
 int SPI_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
-   char buffer[100];
+   struct spi_data *data = r->data;
    if(address+4 > r->size) {
      fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
      return 0;
@@ -45,28 +125,48 @@ int SPI_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory write 0x%08x\n", r->base+address);
    }
-   sprintf(buffer,"SPI Wr address 0x%08x: 0x%08x", address, value);
-   display_log(buffer);
+   log_msg(LOG_SPI, LOG_DEBUG, "SPI Wr address 0x%08x: 0x%08x", address, value);
+
+   switch(address) {
+     case SPI_TXDATA:
+       transfer(data, value & 0xFF);
+       return 1;
+     case SPI_RXDATA:
+     case SPI_IP:
+       /* Read only */
+       return 1;
+   }
 
    if(mask & 1) {
-      ((unsigned char *)r->data)[address+0] = value; 
+      data->regs[address+0] = value; 
    }
    if(mask & 2) {
-      ((unsigned char *)r->data)[address+1] = value>>8; 
+      data->regs[address+1] = value>>8; 
    }
    if(mask & 4) {
-      ((unsigned char *)r->data)[address+2] = value>>16; 
+      data->regs[address+2] = value>>16; 
    }
    if(mask & 8) {
-      ((unsigned char *)r->data)[address+3] = value>>24; 
+      data->regs[address+3] = value>>24; 
    }
+
+   /* Leaving HOLD mode releases the chip select */
+   if(address == SPI_CSMODE && (reg_get(data, SPI_CSMODE) & 3) != SPI_CSMODE_HOLD)
+     deselect(data);
    return 1;
 }
 
+/****************************************************************************
+ * Only reading rxdata changes anything - it pops the receive FIFO
+ ****************************************************************************/
+int SPI_pure(struct region *r, uint32_t address) {
+   return address != SPI_RXDATA;
+}
+
 /****************************************************************************/
 int SPI_get(struct region *r, uint32_t address, uint32_t *value) {
+   struct spi_data *data = r->data;
    uint32_t v = 0;
-   char buffer[100];
    if((address & 3) != 0) {
      fprintf(stderr,"Unaligned memory read 0x%08x\n", r->base+address);
      return 0;
@@ -77,23 +177,41 @@ int SPI_get(struct region *r, uint32_t address, uint32_t *value) {
      return 0;
    }
 
-   v = ((unsigned char *)r->data)[address]; 
-   v = v + (((unsigned char *)r->data)[address+1] << 8); 
-   v = v + (((unsigned char *)r->data)[address+2] << 16); 
-   v = v + (((unsigned char *)r->data)[address+3] << 24); 
+   switch(address) {
+     case SPI_TXDATA:
+       /* Frames go out as soon as they are written, so never full */
+       v = 0;
+       break;
+     case SPI_RXDATA:
+       if(data->rx_count > 0) {
+         v = data->rx_fifo[data->rx_read_ptr];
+         data->rx_read_ptr = (data->rx_read_ptr + 1) % SPI_FIFO_SIZE;
+         data->rx_count--;
+       } else {
+         v = 1u << 31;
+       }
+       break;
+     case SPI_IP:
+       v  = reg_get(data, SPI_TXMARK) > 0 ? 1 : 0;
+       v |= data->rx_count > reg_get(data, SPI_RXMARK) ? 2 : 0;
+       break;
+     default:
+       v = reg_get(data, address);
+       break;
+   }
 
    if(address == 0)
      v |= 1<<31;
    *value = v;
      
-   sprintf(buffer,"SPI Rd address 0x%08x: 0x%08x", address, v);
-   display_log(buffer);
+   log_msg(LOG_SPI, LOG_DEBUG, "SPI Rd address 0x%08x: 0x%08x", address, v);
 
    return 1;
 }
 
 /****************************************************************************/
 void SPI_dump(struct region *r) {
+   struct spi_data *data = r->data;
    int i;
 
    printf("SPI 0x%08x length 0x%08x\n", r->base, r->size);
@@ -101,7 +219,7 @@ void SPI_dump(struct region *r) {
       if(i%32 == 0) {
 	 printf("%08x:", r->base+i);
       }
-      printf(" %02x", ((unsigned char *)(r->data))[i]);
+      printf(" %02x", data->regs[i]);
       if(i%32 == 31)
 	 printf("\n");
    }
@@ -113,7 +231,11 @@ void SPI_free(struct region *r) {
    char buffer[100];
    sprintf(buffer, "Releasing SPI at 0x%08x", r->base);
    display_log(buffer);
-   if(r->data != NULL) 
-     free(r->data);
+   if(r->data != NULL) {
+     struct spi_data *data = r->data;
+     deselect(data);
+     free(data->regs);
+     free(data);
+   }
 }
 /****************************************************************************/
@@ -0,0 +1,232 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <elf.h>
+#include "symbols.h"
+#include "display.h"
+
+/****************************************************************************
+ * Address to function name lookup, from the symbol tables of the ELF files
+ * that get loaded.
+ *
+ * Code symbols are kept sorted by address, each covering the range from
+ * its address to its address plus its size - or to the next symbol (or
+ * the end of its section) if it has no size, as is usual for assembler
+ * labels. A lookup is a binary
+ * search, but the last symbol found is tried first as the next address
+ * asked about is usually in the same function.
+ ****************************************************************************/
+struct symbol {
+  uint32_t address;
+  uint32_t end;
+  uint32_t name;      /* Offset into names */
+  uint8_t  sized;
+  uint8_t  rank;      /* Which to keep when two share an address */
+};
+
+static struct symbol *symbols;
+static int n_symbols;
+static char *names;
+static uint32_t names_used;
+static int last = -1;
+
+/****************************************************************************/
+static int compare(const void *a, const void *b) {
+  const struct symbol *sa = a, *sb = b;
+
+  if(sa->address != sb->address)
+    return sa->address < sb->address ? -1 : 1;
+  /* Best first, so it is the one kept */
+  return (int)sb->rank - (int)sa->rank;
+}
+
+/****************************************************************************
+ * Sort, drop duplicate addresses and work out where each symbol ends
+ ****************************************************************************/
+static void build(void) {
+  int i, n = 0;
+
+  qsort(symbols, n_symbols, sizeof(struct symbol), compare);
+  for(i = 0; i < n_symbols; i++) {
+    if(n > 0 && symbols[n-1].address == symbols[i].address)
+      continue;
+    symbols[n++] = symbols[i];
+  }
+  n_symbols = n;
+
+  for(i = 0; i < n_symbols; i++) {
+    uint32_t next = (i+1 < n_symbols) ? symbols[i+1].address : 0xFFFFFFFF;
+    if(symbols[i].end > next)
+      symbols[i].end = next;
+  }
+  last = -1;
+}
+
+/****************************************************************************/
+static int wanted(const Elf32_Sym *sym, const Elf32_Shdr *sh, int n_sh, const char *name) {
+  int type = ELF32_ST_TYPE(sym->st_info);
+
+  if(type != STT_FUNC && type != STT_NOTYPE)
+    return 0;
+  if(sym->st_shndx == SHN_UNDEF || sym->st_shndx >= n_sh)
+    return 0;
+  if(!(sh[sym->st_shndx].sh_flags & SHF_EXECINSTR))
+    return 0;
+  /* Mapping symbols and compiler generated local labels */
+  if(name[0] == '\0' || name[0] == '$' || strncmp(name, ".L", 2) == 0)
+    return 0;
+  return 1;
+}
+
+/****************************************************************************
+ * Add the code symbols from an ELF file's symbol tables
+ ****************************************************************************/
+int symbols_load_elf(const uint8_t *map, size_t size) {
+  const Elf32_Ehdr *eh = (const Elf32_Ehdr *)map;
+  const Elf32_Shdr *sh;
+  char buffer[100];
+  int i, added = 0;
+
+  if(eh->e_shoff == 0 || eh->e_shentsize != sizeof(Elf32_Shdr)
+     || eh->e_shoff + (size_t)eh->e_shnum * sizeof(Elf32_Shdr) > size)
+    return 0;
+  sh = (const Elf32_Shdr *)(map + eh->e_shoff);
+
+  for(i = 0; i < eh->e_shnum; i++) {
+    const Elf32_Sym *syms;
+    const char *strtab;
+    uint32_t n, j, strsize;
+
+    if(sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+      continue;
+    if((size_t)sh[i].sh_offset + sh[i].sh_size > size
+       || (size_t)sh[sh[i].sh_link].sh_offset + sh[sh[i].sh_link].sh_size > size)
+      continue;
+
+    syms    = (const Elf32_Sym *)(map + sh[i].sh_offset);
+    n       = sh[i].sh_size / sizeof(Elf32_Sym);
+    strtab  = (const char *)map + sh[sh[i].sh_link].sh_offset;
+    strsize = sh[sh[i].sh_link].sh_size;
+
+    /* Room for the lot, so there is no growing as they are added */
+    {
+      struct symbol *s = realloc(symbols, (n_symbols+n+1) * sizeof(struct symbol));
+      char *p;
+      if(s == NULL)
+        return 0;
+      symbols = s;
+      p = realloc(names, names_used + strsize + 1);
+      if(p == NULL)
+        return 0;
+      names = p;
+    }
+
+    for(j = 0; j < n; j++) {
+      const char *name;
+      struct symbol *s;
+      uint32_t len;
+
+      if(syms[j].st_name >= strsize)
+        continue;
+      name = strtab + syms[j].st_name;
+      if(!wanted(syms+j, sh, eh->e_shnum, name))
+        continue;
+      len = strnlen(name, strsize - syms[j].st_name);
+      memcpy(names + names_used, name, len);
+      names[names_used + len] = '\0';
+
+      s = symbols + n_symbols++;
+      s->address = syms[j].st_value & ~1;
+      s->sized   = syms[j].st_size != 0;
+      if(s->sized)
+        s->end = s->address + syms[j].st_size;
+      else
+        s->end = sh[syms[j].st_shndx].sh_addr + sh[syms[j].st_shndx].sh_size;
+      s->name    = names_used;
+      /* Prefer functions, then globals, then ones with a size */
+      s->rank    = (ELF32_ST_TYPE(syms[j].st_info) == STT_FUNC) * 4
+                 + (ELF32_ST_BIND(syms[j].st_info) != STB_LOCAL) * 2
+                 + s->sized;
+      names_used += len + 1;
+      added++;
+    }
+  }
+
+  if(added == 0)
+    return 0;
+  build();
+  sprintf(buffer, "Loaded %i symbols", added);
+  display_log(buffer);
+  return 1;
+}
+
+/****************************************************************************
+ * The name of the function holding address and how far into it it is,
+ * or NULL if it isn't in any
+ ****************************************************************************/
+const char *symbols_lookup(uint32_t address, uint32_t *offset) {
+  int lo = 0, hi = n_symbols-1;
+
+  if(last < 0 || address < symbols[last].address || address >= symbols[last].end) {
+    /* Find the last symbol starting at or below the address */
+    last = -1;
+    while(lo <= hi) {
+      int mid = (lo+hi)/2;
+      if(symbols[mid].address <= address) {
+        last = mid;
+        lo = mid+1;
+      } else {
+        hi = mid-1;
+      }
+    }
+    if(last < 0 || address >= symbols[last].end) {
+      last = -1;
+      return NULL;
+    }
+  }
+
+  if(offset != NULL)
+    *offset = address - symbols[last].address;
+  return names + symbols[last].name;
+}
+
+/****************************************************************************
+ * Write address as "name" or "name+0x1c", or in hex if it isn't known
+ ****************************************************************************/
+int symbols_format(uint32_t address, char *buffer, int len) {
+  uint32_t offset;
+  const char *name = symbols_lookup(address, &offset);
+
+  if(name == NULL)
+    return snprintf(buffer, len, "0x%08x", address);
+  if(offset == 0)
+    return snprintf(buffer, len, "%s", name);
+  return snprintf(buffer, len, "%s+0x%x", name, offset);
+}
+
+/****************************************************************************/
+int symbols_count(void) {
+  return n_symbols;
+}
+
+/****************************************************************************/
+void symbols_free(void) {
+  free(symbols);
+  free(names);
+  symbols    = NULL;
+  names      = NULL;
+  n_symbols  = 0;
+  names_used = 0;
+  last = -1;
+}
+/****************************************************************************/
@@ -0,0 +1,8 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+int  symbols_load_elf(const uint8_t *map, size_t size);
+const char *symbols_lookup(uint32_t address, uint32_t *offset);
+int  symbols_format(uint32_t address, char *buffer, int len);
+int  symbols_count(void);
+void symbols_free(void);
+#endif
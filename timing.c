@@ -0,0 +1,113 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "timing.h"
+#include "config.h"
+#include "display.h"
+
+/****************************************************************************
+ * Pipeline timing model.
+ *
+ * Each class of instruction has a result latency - the cycles after it
+ * finishes before what it wrote to rd can be used. A scoreboard keeps
+ * when each register will be ready, and an instruction that reads one
+ * too soon waits for it, so a load followed straight away by a use of
+ * what it loaded (a load-use hazard) or a chain of multiplies costs extra,
+ * while independent work in between hides the latency.
+ *
+ * The latency counts from when the instruction issued, so for a load it
+ * overlaps the cycles already spent waiting on memory rather than being
+ * added after them.
+ *
+ * The cycles waited are counted by the class that caused them.
+ ****************************************************************************/
+#define N_CLASSES 5
+
+int timing_active = 0;
+
+static uint32_t latency[N_CLASSES];
+static uint64_t ready[32];      /* Cycle each register's value is usable */
+static uint8_t  producer[32];   /* Class of the instruction that wrote it */
+static uint64_t waited[N_CLASSES];
+static uint64_t issued;         /* When the latest instruction issued */
+
+static const char *class_names[N_CLASSES] = { "alu", "mul", "div", "load", "csr" };
+
+/****************************************************************************
+ * From a machine description line such as
+ *
+ *    pipeline mul=3 div=32 load=1
+ ****************************************************************************/
+int timing_configure(const char *options) {
+  char buffer[128];
+  int used = 0, i;
+
+  used += sprintf(buffer, "Pipeline latencies:");
+  for(i = 0; i < N_CLASSES; i++) {
+    latency[i] = 0;
+    config_option_number(options, class_names[i], &latency[i]);
+    used += sprintf(buffer+used, " %s=%u", class_names[i], latency[i]);
+  }
+  display_log(buffer);
+  timing_reset();
+  timing_active = 1;
+  return 1;
+}
+
+/****************************************************************************
+ * An instruction reading the registers in the sources bitmask is about to
+ * run. Returns how many cycles it has to wait for them.
+ ****************************************************************************/
+uint32_t timing_issue(uint32_t sources, uint64_t now) {
+  uint64_t latest = now;
+  int i, cause = TIMING_ALU;
+
+  for(i = 1; sources >> i; i++) {
+    if(((sources >> i) & 1) && ready[i] > latest) {
+      latest = ready[i];
+      cause  = producer[i];
+    }
+  }
+  waited[cause] += latest - now;
+  issued = latest;
+  return latest - now;
+}
+
+/****************************************************************************
+ * The latest instruction, of the given class, has written rd
+ ****************************************************************************/
+void timing_complete(int rd, int class, uint64_t now) {
+  if(rd == 0)
+    return;
+  ready[rd]    = issued + latency[class] > now ? issued + latency[class] : now;
+  producer[rd] = class;
+}
+
+/****************************************************************************/
+void timing_reset(void) {
+  memset(ready, 0, sizeof(ready));
+}
+
+/****************************************************************************/
+void timing_finish(void) {
+  char buffer[200];
+  int used = 0, i;
+
+  if(!timing_active)
+    return;
+  used += sprintf(buffer, "Cycles waiting on results:");
+  for(i = 0; i < N_CLASSES; i++)
+    used += sprintf(buffer+used, " %s %llu", class_names[i], (unsigned long long)waited[i]);
+  display_log(buffer);
+  timing_active = 0;
+}
+/****************************************************************************/
@@ -0,0 +1,18 @@
+#ifndef TIMING_H
+#define TIMING_H
+/* Instruction classes, each with its own result latency */
+#define TIMING_ALU   0
+#define TIMING_MUL   1
+#define TIMING_DIV   2
+#define TIMING_LOAD  3
+#define TIMING_CSR   4
+
+/* Set when a pipeline is described, so the CPU only calls in when it is wanted */
+extern int timing_active;
+
+int      timing_configure(const char *options);
+uint32_t timing_issue(uint32_t sources, uint64_t now);
+void     timing_complete(int rd, int class, uint64_t now);
+void     timing_reset(void);
+void     timing_finish(void);
+#endif
@@ -13,13 +13,34 @@
 #include <memory.h>
 #include "region.h"
 #include "ram.h"
+#include "config.h"
+#include "riscv.h"
+#include "event.h"
+#include "uart_backend.h"
+#include "script.h"
+#include "plic.h"
 #include "display.h"
+#include "log.h"
 
-#define UART_DEBUG 0
 #define UART_FIFO_SIZE 8
 #define UART_QUEUE_DEPTH 8
+#define UART_POLL_CYCLES 10000
+
+/* Instant mode sends characters as soon as they are written, timed mode
+ * sends them at the rate set by the divisor */
+#define UART_MODE_INSTANT 0
+#define UART_MODE_TIMED   1
+
 struct uart_data {
   uint16_t divisor; 
+  uint8_t  mode;
+  struct event tx_event;
+  struct uart_backend *backend;
+  struct event poll_event;
+  uint32_t poll_cycles;
+  uint8_t  console;
+  uint32_t irq;
+  uint8_t  irq_level;
 
   uint8_t tx_fifo[UART_FIFO_SIZE];
   uint8_t tx_read_ptr;
@@ -40,11 +61,117 @@ struct uart_data {
   uint8_t rx_irq_tx_pending;
   uint8_t rx_irq_rx_pending;
   uint8_t stop_bits;
-  uint8_t debug;
 };
+
+/* The first UART is the console, which a script talks to */
+static struct uart_data *console;
+
+/****************************************************************************
+ * Each character is a start bit, 8 data bits and the stop bits, and each
+ * bit takes divisor+1 cycles of tlclk - which on the FE310 is the core
+ * clock set up by the PRCI, so the same as the CPU cycle count.
+ ****************************************************************************/
+static uint64_t char_cycles(struct uart_data *data) {
+  return (uint64_t)(data->divisor+1) * (1 + 8 + data->stop_bits);
+}
+
+/****************************************************************************
+ * The interrupt line is the OR of the enabled watermark interrupts. Only
+ * changes are passed on to the PLIC.
+ ****************************************************************************/
+static void update_irq(struct uart_data *data) {
+  uint8_t level = (data->tx_irq_enable && data->tx_count < data->tx_watermark)
+               || (data->rx_irq_enable && data->rx_count > data->rx_watermark);
+
+  if(data->irq != 0 && level != data->irq_level) {
+    data->irq_level = level;
+    plic_set_source(data->irq, level);
+  }
+}
+
+/****************************************************************************/
+static void tx_send_one(struct uart_data *data) {
+  if(data->console && script_active())
+    script_uart_tx(data->tx_fifo[data->tx_read_ptr]);
+  uart_backend_write(data->backend, data->tx_fifo[data->tx_read_ptr]);
+  data->tx_count--;
+  data->tx_read_ptr = (data->tx_read_ptr == UART_FIFO_SIZE-1) ? 0 : data->tx_read_ptr+1;
+  update_irq(data);
+}
+
+/****************************************************************************/
+static void tx_event(struct event *e, uint64_t now) {
+  struct uart_data *data = e->data;
+
+  if(!data->tx_enable || data->tx_count == 0)
+    return;
+
+  tx_send_one(data);
+  if(data->tx_count > 0)
+    event_schedule(&data->tx_event, now + char_cycles(data));
+}
+
+/****************************************************************************/
+static void tx_start(struct uart_data *data) {
+  if(!data->tx_enable || data->tx_count == 0)
+    return;
+
+  if(data->mode == UART_MODE_INSTANT) {
+    while(data->tx_count > 0)
+      tx_send_one(data);
+  } else if(!event_pending(&data->tx_event)) {
+    event_schedule(&data->tx_event, riscv_cycles() + char_cycles(data));
+  }
+}
+
+/****************************************************************************
+ * Every so often push out any buffered output and move whatever input is
+ * waiting into the RX FIFO. In timed mode only one character can arrive
+ * per character time.
+ ****************************************************************************/
+static void rx_fill(struct uart_data *data) {
+  uint8_t buffer[UART_FIFO_SIZE];
+  int space, i, n;
+
+  if(!data->rx_enable)
+    return;
+
+  space = UART_FIFO_SIZE - data->rx_count;
+  if(data->mode == UART_MODE_TIMED && space > 1)
+    space = 1;
+
+  /* Scripted input comes first */
+  n = 0;
+  if(data->console && script_active())
+    n = script_uart_rx(buffer, space);
+  if(n == 0)
+    n = uart_backend_read(data->backend, buffer, space);
+  for(i = 0; i < n; i++) {
+    data->rx_fifo[data->rx_write_ptr] = buffer[i];
+    data->rx_count++;
+    data->rx_write_ptr = (data->rx_write_ptr == UART_FIFO_SIZE-1) ? 0 : data->rx_write_ptr+1;
+  }
+  update_irq(data);
+}
+
+/****************************************************************************/
+static void poll_event(struct event *e, uint64_t now) {
+  struct uart_data *data = e->data;
+  uint64_t next = data->poll_cycles;
+
+  uart_backend_flush(data->backend);
+  rx_fill(data);
+
+  if(data->mode == UART_MODE_TIMED && char_cycles(data) < next)
+    next = char_cycles(data);
+  event_schedule(&data->poll_event, now + next);
+}
+
 /****************************************************************************/
 int UART_init(struct region *r) {
   struct uart_data *data;
+  char option[16];
+  char spec[256];
 
   if(r->data != NULL) {
     display_log("UART already initialized");
@@ -57,8 +184,49 @@ int UART_init(struct region *r) {
   }
 
   memset(data, 0, sizeof(struct uart_data));
-  data->divisor = 0xffff;
-  data->debug   = UART_DEBUG;
+  data->divisor   = 0xffff;
+  data->stop_bits = 1;
+
+  data->mode = UART_MODE_INSTANT;
+  if(config_option(r->options, "mode", option, sizeof(option))) {
+    if(strcmp(option, "timed") == 0) {
+      data->mode = UART_MODE_TIMED;
+    } else if(strcmp(option, "instant") != 0) {
+      display_log("UART mode must be 'timed' or 'instant'");
+      free(data);
+      return 0;
+    }
+  }
+  event_init(&data->tx_event, tx_event, data);
+
+  config_option_number(r->options, "irq", &data->irq);
+
+  data->poll_cycles = UART_POLL_CYCLES;
+  config_option_number(r->options, "poll", &data->poll_cycles);
+  if(data->poll_cycles == 0)
+    data->poll_cycles = 1;
+
+  if(!config_option(r->options, "backend", spec, sizeof(spec)))
+    strcpy(spec, "display");
+  data->backend = uart_backend_open(spec);
+  if(data->backend == NULL) {
+    char buffer[300];
+    snprintf(buffer, sizeof(buffer), "Unable to open UART backend '%s'", spec);
+    display_log(buffer);
+    free(data);
+    return 0;
+  }
+
+  if(console == NULL) {
+    console = data;
+    data->console = 1;
+  }
+
+  /* The display needs no polling unless a script is feeding the console,
+   * the others are flushed and read */
+  event_init(&data->poll_event, poll_event, data);
+  if(strcmp(spec, "display") != 0 || (data->console && script_active()))
+    event_schedule(&data->poll_event, riscv_cycles() + data->poll_cycles);
   r->data = (void *)data;
 
   display_log("Set up UART region");
@@ -67,7 +235,6 @@ int UART_init(struct region *r) {
 
 /****************************************************************************/
 int UART_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
-   char buffer[100];
    struct uart_data *data = r->data;
    if(address+4 > r->size) {
      fprintf(stderr,"Memory region boundary crossed at 0x%08x\n", r->base+address);
@@ -86,15 +253,9 @@ int UART_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
 	   data->tx_count++;
            data->tx_write_ptr = (data->tx_write_ptr == UART_FIFO_SIZE-1) ? 0 : data->tx_write_ptr+1;
 
-	   if(data->debug) {
-             sprintf(buffer,"UART data added to tx queue 0x%02x", value & 0xff);
-             display_log(buffer);
-	   }
+	   log_msg(LOG_UART, LOG_DEBUG, "UART data added to tx queue 0x%02x", value & 0xff);
          } else {
-           if(data->debug) {
-             sprintf(buffer,"UART tx queue overflow adding 0x%02x", value & 0xff);
-             display_log(buffer);
-           }
+           log_msg(LOG_UART, LOG_DEBUG, "UART tx queue overflow adding 0x%02x", value & 0xff);
 	 }
 	 break;    
      case 0x04:
@@ -103,86 +264,66 @@ int UART_set(struct region *r, uint32_t address, uint8_t mask, uint32_t value) {
 	 data->tx_enable    = (value  &  1) ? 1 : 0;
 	 data->stop_bits    = (value  &  2) ? 2 : 1;
 	 data->tx_watermark = (value >> 16) & 0x7;
-         if(data->debug) {
-           sprintf(buffer,"UART set tx_enable = %i, stop_bits = %i, tx_watermark = %i",
+         log_msg(LOG_UART, LOG_DEBUG, "UART set tx_enable = %i, stop_bits = %i, tx_watermark = %i",
 		data->tx_enable, data->stop_bits, data->tx_watermark);
-           display_log(buffer);
-         }
 	 break;
      case 0x0C:
 	 data->rx_enable    = (value  &  1) ? 1 : 0;
 	 data->rx_watermark = (value >> 16) & 0x7;
-         if(data->debug) {
-           sprintf(buffer,"UART set rx_enable = %i, rx_watermark = %i",
+         log_msg(LOG_UART, LOG_DEBUG, "UART set rx_enable = %i, rx_watermark = %i",
 		data->rx_enable, data->rx_watermark);
-           display_log(buffer);
-         }
 	 break;
      case 0x10:
 	 data->rx_irq_enable = (value  &  1) ? 1 : 0;
 	 data->tx_irq_enable = (value  &  2) ? 1 : 0;
-         if(data->debug) {
-           sprintf(buffer,"UART set rx_irq_enable = %i, tx_irq_enable = %i",
+         log_msg(LOG_UART, LOG_DEBUG, "UART set rx_irq_enable = %i, tx_irq_enable = %i",
                  data->rx_irq_enable, data->tx_irq_enable);
-           display_log(buffer);
-         }
 	 break;
      case 0x14:
 	 break;
      case 0x18:
 	 data->divisor = value & 0xFFFF;
-	 if(data->debug) {
-           sprintf(buffer,"UART Divisor set to 0x%08x", value);
-           display_log(buffer);
-	 }
+	 log_msg(LOG_UART, LOG_DEBUG, "UART Divisor set to 0x%08x", value);
 	 break;
      default:
-         sprintf(buffer,"UART Wr unkown address 0x%08x: 0x%08x", address, value);
-         display_log(buffer);
+         log_msg(LOG_UART, LOG_WARN, "UART Wr unkown address 0x%08x: 0x%08x", address, value);
 	 break;
    }
 
-   // SHould I flush the queue? 
-   if(data->tx_enable) {
-     while(data->tx_count > 0) {
-       display_uart_write(data->tx_fifo[data->tx_read_ptr] & 0xFF);
-       data->tx_count--;
-       data->tx_read_ptr = (data->tx_read_ptr == UART_FIFO_SIZE-1) ? 0 : data->tx_read_ptr+1;
-     }
-   }
+   // Start sending anything in the queue
+   tx_start(data);
+   update_irq(data);
    return 1;
 }
 
 /****************************************************************************/
 void UART_rx_enqueue(struct region *r, uint8_t c) {
-  char buffer[100];
   struct uart_data *data = r->data;
   if(data->rx_enable) {
     if(data->rx_count < UART_QUEUE_DEPTH) {
-      data->rx_fifo[data->tx_write_ptr] = c;
+      data->rx_fifo[data->rx_write_ptr] = c;
       data->rx_count++;
-      data->tx_write_ptr = (data->tx_write_ptr == UART_FIFO_SIZE-1) ? 0 : data->tx_write_ptr+1;
-      if(data->debug) {
-        sprintf(buffer,"UART data added to rx queue 0x%02x", c);
-        display_log(buffer);
-      }
+      data->rx_write_ptr = (data->rx_write_ptr == UART_FIFO_SIZE-1) ? 0 : data->rx_write_ptr+1;
+      update_irq(data);
+      log_msg(LOG_UART, LOG_DEBUG, "UART data added to rx queue 0x%02x", c);
     } else {
-      if(data->debug) {
-        sprintf(buffer,"UART rx queue overflow adding 0x%02x", c);
-        display_log(buffer);
-      }
+      log_msg(LOG_UART, LOG_DEBUG, "UART rx queue overflow adding 0x%02x", c);
     }
   } else {
-    if(data->debug) {
-      sprintf(buffer,"UART rx disabled while adding 0x%02x", c);
-      display_log(buffer);
-    }
+    log_msg(LOG_UART, LOG_DEBUG, "UART rx disabled while adding 0x%02x", c);
   }
 }
+
+/****************************************************************************
+ * Reading rxdata pops the receive FIFO, other reads change nothing
+ ****************************************************************************/
+int UART_pure(struct region *r, uint32_t address) {
+   return address != 0x04;
+}
+
 /****************************************************************************/
 int UART_get(struct region *r, uint32_t address, uint32_t *value) {
    uint32_t v = 0;
-   char buffer[100];
    struct uart_data *data = r->data;
 
    if((address & 3) != 0) {
@@ -200,11 +341,8 @@ int UART_get(struct region *r, uint32_t address, uint32_t *value) {
    switch(address) {
      case 0x00:
        v = (data->tx_count == UART_QUEUE_DEPTH) ? (1<<31) : 0;
-       if(data->debug) {
-         sprintf(buffer,"UART is %s to accept tx data",
+       log_msg(LOG_UART, LOG_DEBUG, "UART is %s to accept tx data",
            data->tx_count == UART_QUEUE_DEPTH ? "not ready" : "ready");
-         display_log(buffer);
-       }
        break;
      case 0x04:
        if(data->rx_count > 0) {
@@ -212,15 +350,10 @@ int UART_get(struct region *r, uint32_t address, uint32_t *value) {
 	 data->rx_count--;
 	 data->rx_read_ptr = (data->rx_read_ptr == UART_FIFO_SIZE-1) ? 0 : data->rx_read_ptr+1;
 
-         if(data->debug) {
-           sprintf(buffer,"UART rx queue read - 0x%03x", v);
-	   display_log(buffer);
-         }
+         log_msg(LOG_UART, LOG_DEBUG, "UART rx queue read - 0x%03x", v);
        } else {
          v = (1<<31);
-         if(data->debug) {
-           display_log("UART rx queue is empty");
-         }
+         log_msg(LOG_UART, LOG_DEBUG, "UART rx queue is empty");
        }
        break;
      case 0x08:
@@ -228,54 +361,39 @@ int UART_get(struct region *r, uint32_t address, uint32_t *value) {
        v |= data->tx_enable      ? 1 : 0;
        v |= data->stop_bits == 2 ? 2 : 0;
        v |= (data->tx_watermark << 16);
-       if(data->debug) {
-         sprintf(buffer,"UART get tx_enable = %i, stop_bits = %i, tx_watermark = %i",
+       log_msg(LOG_UART, LOG_DEBUG, "UART get tx_enable = %i, stop_bits = %i, tx_watermark = %i",
            data->tx_enable, data->stop_bits, data->tx_watermark);
-         display_log(buffer);
-       }
        break;
      case 0x0C:
        v = 0;
        v |= data->rx_enable      ? 1 : 0;
-       v |= (data->tx_watermark << 16);
-       if(data->debug) {
-         sprintf(buffer,"UART get rx_enable = %i, rx_watermark = %i",
+       v |= (data->rx_watermark << 16);
+       log_msg(LOG_UART, LOG_DEBUG, "UART get rx_enable = %i, rx_watermark = %i",
            data->rx_enable, data->rx_watermark);
-         display_log(buffer);
-       }
        break;
      case 0x10:
        v = 0;
        v |= data->rx_irq_enable ? 1 : 0;
        v |= data->tx_irq_enable ? 2 : 0;
-       if(data->debug) {
-         sprintf(buffer,"UART get rx_irq_enable = %i, tx_irq_enable = %i",
+       log_msg(LOG_UART, LOG_DEBUG, "UART get rx_irq_enable = %i, tx_irq_enable = %i",
                  data->rx_irq_enable, data->tx_irq_enable);
-         display_log(buffer);
-       }
        break;
      case 0x14:
        v = 0;
-       v |= data->tx_count > data->tx_watermark ? 1 : 0;
+       v |= data->tx_count < data->tx_watermark ? 1 : 0;
        v |= data->rx_count > data->rx_watermark ? 2 : 0;
-       if(data->debug) {
-         sprintf(buffer,"UART get rx_irq_pending = %i, tx_irq_pending = %i",
+       log_msg(LOG_UART, LOG_DEBUG, "UART get tx_irq_pending = %i, rx_irq_pending = %i",
                  v&1, v>>1);
-         display_log(buffer);
-       }
        break;
      case 0x18:
        v = data->divisor;
-       if(data->debug) {
-         sprintf(buffer,"UART get divisor = 0x%08x", v);
-         display_log(buffer);
-       }
+       log_msg(LOG_UART, LOG_DEBUG, "UART get divisor = 0x%08x", v);
        break;
      default:
-       sprintf(buffer,"UART Wr unkown address 0x%08x: 0x%08x", address, v);
-       display_log(buffer);
+       log_msg(LOG_UART, LOG_WARN, "UART Rd unkown address 0x%08x: 0x%08x", address, v);
        break;
    }
+   update_irq(data);
    *value = v;
 
    return 1;
@@ -290,7 +408,14 @@ void UART_free(struct region *r) {
    char buffer[100];
    sprintf(buffer, "Releasing UART at 0x%08x", r->base);
    display_log(buffer);
-   if(r->data != NULL) 
-     free(r->data);
+   if(r->data != NULL) {
+     struct uart_data *data = r->data;
+     event_cancel(&data->tx_event);
+     event_cancel(&data->poll_event);
+     uart_backend_close(data->backend);
+     if(console == data)
+       console = NULL;
+     free(data);
+   }
 }
 /****************************************************************************/
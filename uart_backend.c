@@ -0,0 +1,311 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "uart_backend.h"
+#include "display.h"
+
+/****************************************************************************
+ * Where a UART's characters go to and come from. The spec is one of
+ *
+ *   display        the UART window (the default)
+ *   stdout         standard output, and standard input when running
+ *                  without the display
+ *   file:PATH      output written to PATH, no input
+ *   pipe:PATH      named pipes PATH.out and PATH.in, created if needed
+ *   socket:PATH    a Unix-domain socket listening on PATH, one client
+ *   pty            a new pseudo terminal, its name is logged
+ *
+ * Output is gathered into a buffer and written in one go when it fills or
+ * is flushed. Input is always read non-blocking. stdout and files wait
+ * until they can take the output, while anything a pipe or socket isn't
+ * ready for stays in the buffer for the next flush.
+ ****************************************************************************/
+#define BACKEND_DISPLAY 0
+#define BACKEND_STDOUT  1
+#define BACKEND_FILE    2
+#define BACKEND_PIPE    3
+#define BACKEND_SOCKET  4
+#define BACKEND_PTY     5
+
+#define BACKEND_BUFFER_SIZE 4096
+
+struct uart_backend {
+  int      type;
+  int      out_fd;
+  int      in_fd;
+  int      listen_fd;
+  int      stdin_flags;   /* To put back at close, or -1 if untouched */
+  char    *path;
+  int      used;
+  uint8_t  buffer[BACKEND_BUFFER_SIZE];
+};
+
+/****************************************************************************
+ * Returns the flags from before, or -1 if it failed
+ ****************************************************************************/
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+    return -1;
+  return flags;
+}
+
+/****************************************************************************/
+static int open_fifo(const char *path, const char *suffix, int flags) {
+  char name[300];
+
+  snprintf(name, sizeof(name), "%s%s", path, suffix);
+  if(mkfifo(name, 0600) != 0 && errno != EEXIST)
+    return -1;
+  /* Opening read/write means neither end blocks waiting for the other */
+  return open(name, O_RDWR | O_NONBLOCK | flags);
+}
+
+/****************************************************************************/
+static int open_socket(struct uart_backend *b, const char *path) {
+  struct sockaddr_un addr;
+
+  if(strlen(path) >= sizeof(addr.sun_path))
+    return 0;
+
+  b->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(b->listen_fd < 0)
+    return 0;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if(bind(b->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+     || listen(b->listen_fd, 1) != 0
+     || set_nonblocking(b->listen_fd) < 0) {
+    close(b->listen_fd);
+    b->listen_fd = -1;
+    return 0;
+  }
+  b->path = strdup(path);
+  return 1;
+}
+
+/****************************************************************************/
+static int open_pty(struct uart_backend *b) {
+  char buffer[300];
+  int fd;
+
+  fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+    return 0;
+  if(grantpt(fd) != 0 || unlockpt(fd) != 0) {
+    close(fd);
+    return 0;
+  }
+  b->in_fd  = fd;
+  b->out_fd = fd;
+  snprintf(buffer, sizeof(buffer), "UART connected to %s", ptsname(fd));
+  display_log(buffer);
+  return 1;
+}
+
+/****************************************************************************/
+struct uart_backend *uart_backend_open(const char *spec) {
+  struct uart_backend *b;
+  int ok = 0;
+
+  b = malloc(sizeof(struct uart_backend));
+  if(b == NULL)
+    return NULL;
+  memset(b, 0, sizeof(struct uart_backend));
+  b->out_fd    = -1;
+  b->in_fd     = -1;
+  b->listen_fd = -1;
+  b->stdin_flags = -1;
+
+  /* A reader going away should show up as EPIPE, not kill the emulator */
+  if(spec != NULL && strcmp(spec, "display") != 0)
+    signal(SIGPIPE, SIG_IGN);
+
+  if(spec == NULL || strcmp(spec, "display") == 0) {
+    b->type = BACKEND_DISPLAY;
+    ok = 1;
+  } else if(strcmp(spec, "stdout") == 0) {
+    b->type   = BACKEND_STDOUT;
+    b->out_fd = STDOUT_FILENO;
+    /* On a tty this is shared with stdout, so it has to be put back */
+    if(display_headless()) {
+      b->stdin_flags = set_nonblocking(STDIN_FILENO);
+      if(b->stdin_flags >= 0)
+        b->in_fd = STDIN_FILENO;
+    }
+    ok = 1;
+  } else if(strncmp(spec, "file:", 5) == 0) {
+    b->type   = BACKEND_FILE;
+    b->out_fd = open(spec+5, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = b->out_fd >= 0;
+  } else if(strncmp(spec, "pipe:", 5) == 0) {
+    b->type   = BACKEND_PIPE;
+    b->out_fd = open_fifo(spec+5, ".out", 0);
+    b->in_fd  = open_fifo(spec+5, ".in", 0);
+    ok = b->out_fd >= 0 && b->in_fd >= 0;
+  } else if(strncmp(spec, "socket:", 7) == 0) {
+    b->type = BACKEND_SOCKET;
+    ok = open_socket(b, spec+7);
+  } else if(strcmp(spec, "pty") == 0) {
+    b->type = BACKEND_PTY;
+    ok = open_pty(b);
+  }
+
+  if(!ok) {
+    uart_backend_close(b);
+    return NULL;
+  }
+  return b;
+}
+
+/****************************************************************************
+ * Pick up a client if the socket has none yet
+ ****************************************************************************/
+static void socket_accept(struct uart_backend *b) {
+  int fd;
+
+  if(b->in_fd >= 0 || b->listen_fd < 0)
+    return;
+
+  fd = accept(b->listen_fd, NULL, NULL);
+  if(fd < 0)
+    return;
+  set_nonblocking(fd);
+  b->in_fd  = fd;
+  b->out_fd = fd;
+  display_log("UART socket client connected");
+}
+
+/****************************************************************************/
+static void socket_drop(struct uart_backend *b) {
+  close(b->in_fd);
+  b->in_fd  = -1;
+  b->out_fd = -1;
+  display_log("UART socket client disconnected");
+}
+
+/****************************************************************************/
+void uart_backend_flush(struct uart_backend *b) {
+  int done = 0;
+
+  if(b->type == BACKEND_SOCKET)
+    socket_accept(b);
+
+  /* Nobody listening - the output is lost, as on a real serial line */
+  if(b->out_fd < 0) {
+    b->used = 0;
+    return;
+  }
+
+  while(done < b->used) {
+    ssize_t n;
+    if(b->type == BACKEND_SOCKET)
+      n = send(b->out_fd, b->buffer+done, b->used-done, MSG_NOSIGNAL);
+    else
+      n = write(b->out_fd, b->buffer+done, b->used-done);
+    if(n <= 0) {
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n < 0 && errno == EAGAIN && (b->type == BACKEND_STDOUT || b->type == BACKEND_FILE)) {
+        struct pollfd p;
+        p.fd     = b->out_fd;
+        p.events = POLLOUT;
+        poll(&p, 1, -1);
+        continue;
+      }
+      if(b->type == BACKEND_SOCKET && n < 0 && errno != EAGAIN) {
+        socket_drop(b);
+        b->used = 0;
+        return;
+      }
+      break;
+    }
+    done += n;
+  }
+
+  /* Keep what the other end wasn't ready for */
+  memmove(b->buffer, b->buffer+done, b->used-done);
+  b->used -= done;
+}
+
+/****************************************************************************/
+void uart_backend_write(struct uart_backend *b, uint8_t c) {
+  if(b->type == BACKEND_DISPLAY) {
+    display_uart_write(c);
+    return;
+  }
+
+  /* Still full from last time - the other end isn't reading */
+  if(b->used == BACKEND_BUFFER_SIZE)
+    return;
+  b->buffer[b->used++] = c;
+  if(b->used == BACKEND_BUFFER_SIZE)
+    uart_backend_flush(b);
+}
+
+/****************************************************************************
+ * Read up to len bytes without blocking. Returns the number read.
+ ****************************************************************************/
+int uart_backend_read(struct uart_backend *b, uint8_t *data, int len) {
+  ssize_t n;
+
+  if(b->type == BACKEND_SOCKET)
+    socket_accept(b);
+
+  if(b->in_fd < 0 || len == 0)
+    return 0;
+
+  n = read(b->in_fd, data, len);
+  if(n > 0)
+    return n;
+
+  if(b->type == BACKEND_SOCKET && (n == 0 || errno != EAGAIN))
+    socket_drop(b);
+  return 0;
+}
+
+/****************************************************************************/
+void uart_backend_close(struct uart_backend *b) {
+  if(b == NULL)
+    return;
+
+  if(b->used > 0)
+    uart_backend_flush(b);
+
+  if(b->out_fd >= 0 && b->out_fd != STDOUT_FILENO && b->out_fd != b->in_fd)
+    close(b->out_fd);
+  if(b->in_fd >= 0 && b->in_fd != STDIN_FILENO)
+    close(b->in_fd);
+  if(b->stdin_flags >= 0)
+    fcntl(STDIN_FILENO, F_SETFL, b->stdin_flags);
+  if(b->listen_fd >= 0) {
+    close(b->listen_fd);
+    unlink(b->path);
+  }
+  if(b->path != NULL)
+    free(b->path);
+  free(b);
+}
+/****************************************************************************/
@@ -0,0 +1,9 @@
+#ifndef UART_BACKEND_H
+#define UART_BACKEND_H
+struct uart_backend;
+struct uart_backend *uart_backend_open(const char *spec);
+void uart_backend_write(struct uart_backend *b, uint8_t c);
+void uart_backend_flush(struct uart_backend *b);
+int  uart_backend_read(struct uart_backend *b, uint8_t *data, int len);
+void uart_backend_close(struct uart_backend *b);
+#endif
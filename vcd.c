@@ -0,0 +1,220 @@
+/********************************************************************
+ * Part of Mike Field's emulate-risc-v project.
+ *
+ * (c) 2018 Mike Field <hamster@snap.net.nz>
+ *
+ * See https://github.com/hamsternz/emulate-risc-v for licensing
+ * and additional info
+ *
+ ********************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "vcd.h"
+
+/****************************************************************************
+ * Waveform capture of a bus of up to 32 tristate pins, as a VCD file.
+ *
+ * The emulator only drops a small record into a ring buffer when the
+ * pins change. A background thread turns the records into text and
+ * writes the file, so the cost of formatting never lands on the CPU
+ * loop. There is one producer and one consumer, so the ring needs no
+ * lock - just ordered loads and stores of the two counters.
+ *
+ * Time is in CPU cycles, written out as nanoseconds.
+ ****************************************************************************/
+#define VCD_RING_SIZE   (1 << 16)
+#define VCD_RING_MASK   (VCD_RING_SIZE - 1)
+#define VCD_ID_BASE     33
+
+struct vcd_record {
+  uint64_t cycle;
+  uint32_t value;
+  uint32_t enable;
+};
+
+struct vcd {
+  FILE    *f;
+  int      width;
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;
+
+  uint64_t head;          /* Written by the emulator */
+  uint64_t tail;          /* Written by the writer thread */
+  int      stop;
+  uint64_t stalls;
+
+  /* Writer's copy of what has been written out */
+  uint32_t last_value;
+  uint32_t last_enable;
+  struct vcd_record ring[VCD_RING_SIZE];
+};
+
+/****************************************************************************/
+static void write_pin(struct vcd *v, int pin, uint32_t value, uint32_t enable) {
+  char c = ((enable >> pin) & 1) ? '0' + ((value >> pin) & 1) : 'z';
+  fprintf(v->f, "%c%c\n", c, VCD_ID_BASE + pin);
+}
+
+/****************************************************************************/
+static void write_record(struct vcd *v, struct vcd_record *rec) {
+  uint32_t changed = ((rec->value ^ v->last_value) & rec->enable)
+                   | (rec->enable ^ v->last_enable);
+  int pin;
+
+  if(changed == 0)
+    return;
+
+  fprintf(v->f, "#%llu\n", (unsigned long long)rec->cycle);
+  while(changed) {
+    pin = __builtin_ctz(changed);
+    write_pin(v, pin, rec->value, rec->enable);
+    changed &= changed-1;
+  }
+  v->last_value  = rec->value;
+  v->last_enable = rec->enable;
+}
+
+/****************************************************************************/
+static void *writer(void *arg) {
+  struct vcd *v = arg;
+  uint64_t tail = v->tail;
+
+  for(;;) {
+    uint64_t head = __atomic_load_n(&v->head, __ATOMIC_ACQUIRE);
+
+    if(tail == head) {
+      struct timespec ts;
+      if(__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE)) {
+        /* Samples may have gone in just before stop was set */
+        if(__atomic_load_n(&v->head, __ATOMIC_ACQUIRE) == tail)
+          break;
+        continue;
+      }
+      fflush(v->f);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 10000000;
+      if(ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_mutex_lock(&v->lock);
+      if(__atomic_load_n(&v->head, __ATOMIC_ACQUIRE) == tail && !v->stop)
+        pthread_cond_timedwait(&v->wake, &v->lock, &ts);
+      pthread_mutex_unlock(&v->lock);
+      continue;
+    }
+
+    while(tail != head) {
+      write_record(v, &v->ring[tail & VCD_RING_MASK]);
+      tail++;
+    }
+    __atomic_store_n(&v->tail, tail, __ATOMIC_RELEASE);
+  }
+  fflush(v->f);
+  return NULL;
+}
+
+/****************************************************************************/
+struct vcd *vcd_open(const char *fname, const char *scope, int width) {
+  struct vcd *v;
+  int pin;
+
+  if(width < 1 || width > 32)
+    return NULL;
+
+  v = malloc(sizeof(struct vcd));
+  if(v == NULL)
+    return NULL;
+  memset(v, 0, sizeof(struct vcd));
+  v->width = width;
+
+  v->f = fopen(fname, "w");
+  if(v->f == NULL) {
+    free(v);
+    return NULL;
+  }
+  setvbuf(v->f, NULL, _IOFBF, 1 << 16);
+
+  fprintf(v->f, "$comment emulate-risc-v - one time unit per CPU cycle $end\n");
+  fprintf(v->f, "$timescale 1ns $end\n");
+  fprintf(v->f, "$scope module %s $end\n", scope);
+  for(pin = 0; pin < width; pin++)
+    fprintf(v->f, "$var wire 1 %c %s_%i $end\n", VCD_ID_BASE + pin, scope, pin);
+  fprintf(v->f, "$upscope $end\n$enddefinitions $end\n");
+
+  /* Everything starts undriven */
+  fprintf(v->f, "#0\n$dumpvars\n");
+  for(pin = 0; pin < width; pin++)
+    write_pin(v, pin, 0, 0);
+  fprintf(v->f, "$end\n");
+
+  pthread_mutex_init(&v->lock, NULL);
+  pthread_cond_init(&v->wake, NULL);
+  if(pthread_create(&v->thread, NULL, writer, v) != 0) {
+    fclose(v->f);
+    free(v);
+    return NULL;
+  }
+  return v;
+}
+
+/****************************************************************************
+ * Record the state of the pins from this cycle on. Only blocks if the
+ * writer has fallen a whole ring behind.
+ ****************************************************************************/
+void vcd_sample(struct vcd *v, uint64_t cycle, uint32_t value, uint32_t enable) {
+  uint64_t head = v->head;
+  uint64_t used = head - __atomic_load_n(&v->tail, __ATOMIC_ACQUIRE);
+  struct vcd_record *rec;
+
+  if(used == VCD_RING_SIZE) {
+    v->stalls++;
+    pthread_mutex_lock(&v->lock);
+    pthread_cond_signal(&v->wake);
+    pthread_mutex_unlock(&v->lock);
+    while(head - __atomic_load_n(&v->tail, __ATOMIC_ACQUIRE) == VCD_RING_SIZE)
+      sched_yield();
+  }
+
+  rec = &v->ring[head & VCD_RING_MASK];
+  rec->cycle  = cycle;
+  rec->value  = value;
+  rec->enable = enable;
+  __atomic_store_n(&v->head, head+1, __ATOMIC_RELEASE);
+
+  /* Give the writer a nudge as the ring reaches half full */
+  if(used+1 == VCD_RING_SIZE/2) {
+    pthread_mutex_lock(&v->lock);
+    pthread_cond_signal(&v->wake);
+    pthread_mutex_unlock(&v->lock);
+  }
+}
+
+/****************************************************************************/
+uint64_t vcd_close(struct vcd *v) {
+  uint64_t stalls;
+
+  if(v == NULL)
+    return 0;
+
+  pthread_mutex_lock(&v->lock);
+  __atomic_store_n(&v->stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&v->wake);
+  pthread_mutex_unlock(&v->lock);
+  pthread_join(v->thread, NULL);
+
+  fclose(v->f);
+  pthread_mutex_destroy(&v->lock);
+  pthread_cond_destroy(&v->wake);
+  stalls = v->stalls;
+  free(v);
+  return stalls;
+}
+/****************************************************************************/
@@ -0,0 +1,7 @@
+#ifndef VCD_H
+#define VCD_H
+struct vcd;
+struct vcd *vcd_open(const char *fname, const char *scope, int width);
+void vcd_sample(struct vcd *v, uint64_t cycle, uint32_t value, uint32_t enable);
+uint64_t vcd_close(struct vcd *v);
+#endif